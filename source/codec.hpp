@@ -0,0 +1,183 @@
+#pragma once
+#include "server.hpp"
+#include <string_view>
+#include <limits>
+
+// 长度前缀的二进制分帧: [长度头][消息体]
+// 长度头的格式作为模板参数，编译期确定，解析时没有虚函数调用和运行时分支
+// 每种长度头提供:
+//   MAX_SIZE                                  长度头最多占几个字节
+//   int Decode(data, len, uint64_t *body_len) 解析长度头，返回长度头的字节数; 0 表示数据还不够; -1 表示格式错误
+//   size_t Encode(uint64_t body_len, char *out) 写出长度头，返回写了几个字节; 长度头表示不了这个长度时返回 0
+
+// 定长长度头: T 是无符号整数类型(uint8_t/uint16_t/uint32_t/uint64_t)，网络字节序(大端)
+template <class T>
+struct FixedLengthHeader
+{
+    static const size_t MAX_SIZE = sizeof(T);
+    static int Decode(const char *data, size_t len, uint64_t *body_len)
+    {
+        if (len < sizeof(T))
+            return 0;
+        uint64_t val = 0;
+        for (size_t i = 0; i < sizeof(T); i++)
+            val = (val << 8) | (uint8_t)data[i];
+        *body_len = val;
+        return sizeof(T);
+    }
+    static size_t Encode(uint64_t body_len, char *out)
+    {
+        if (body_len > std::numeric_limits<T>::max())
+            return 0; // 截断的长度会让对端把后面所有的帧都解析错
+        for (size_t i = 0; i < sizeof(T); i++)
+            out[i] = (char)(body_len >> (8 * (sizeof(T) - 1 - i)));
+        return sizeof(T);
+    }
+};
+
+// 变长长度头(varint / LEB128): 每个字节低 7 位是数据，最高位为 1 表示后面还有字节，小消息只占 1 个字节
+struct VarintLengthHeader
+{
+    static const size_t MAX_SIZE = 10;
+    static int Decode(const char *data, size_t len, uint64_t *body_len)
+    {
+        uint64_t val = 0;
+        for (size_t i = 0; i < MAX_SIZE; i++)
+        {
+            if (i >= len)
+                return 0;
+            uint8_t byte = data[i];
+            val |= (uint64_t)(byte & 0x7f) << (7 * i);
+            if ((byte & 0x80) == 0)
+            {
+                *body_len = val;
+                return i + 1;
+            }
+        }
+        return -1; // 超过 10 个字节还没结束，不是合法的 varint
+    }
+    static size_t Encode(uint64_t body_len, char *out)
+    {
+        size_t i = 0;
+        while (body_len >= 0x80)
+        {
+            out[i++] = (char)((body_len & 0x7f) | 0x80);
+            body_len >>= 7;
+        }
+        out[i++] = (char)body_len;
+        return i;
+    }
+};
+
+#define CODEC_MAX_FRAME (16 * 1024 * 1024) // 默认的单帧大小上限
+
+// 分帧编解码器: 把连接上的字节流切成一帧一帧的消息交给使用者
+// 作为 TcpServer/TcpClient 的 MessageCallback 使用:
+//   server.SetMessageCallback(std::bind(&LengthCodec<VarintLengthHeader>::OnMessage, &codec, _1, _2));
+template <class Header>
+class LengthCodec
+{
+public:
+    // 收到一帧完整的消息: frame 直接指向连接的输入缓冲区(不拷贝)，只在回调期间有效，需要保存的话要自己拷贝
+    using FrameCallback = std::function<void(const PtrConnection &, std::string_view)>;
+
+private:
+    size_t _max_frame; // 单帧大小上限，超过就认为对端有问题，断开连接
+    FrameCallback _frame_callback;
+
+public:
+    LengthCodec(size_t max_frame = CODEC_MAX_FRAME) : _max_frame(max_frame) {}
+    void SetFrameCallback(const FrameCallback &cb) { _frame_callback = cb; }
+    void SetMaxFrame(size_t max_frame) { _max_frame = max_frame; }
+    // 从输入缓冲区里取出一帧: 返回 1 表示取到了(frame 指向缓冲区里的数据)，0 表示数据还不够，-1 表示格式错误或者超过上限
+    // 取到的帧已经从缓冲区移走(只是移动读位置，不会覆盖数据)，下次往缓冲区写数据之前 frame 都是有效的
+    int NextFrame(Buffer *buf, std::string_view *frame)
+    {
+        uint64_t body_len = 0;
+        int header_len = Header::Decode(buf->ReadAddr(), buf->ReadAbleSize(), &body_len);
+        if (header_len == 0)
+            return 0; // 长度头还不完整
+        if (header_len < 0 || body_len > _max_frame)
+        {
+            ERR_LOG("INVALID FRAME, LENGTH %lu, MAX %zu", body_len, _max_frame);
+            return -1;
+        }
+        uint64_t frame_len = header_len + body_len;
+        if (buf->ReadAbleSize() < frame_len)
+        {
+            // 大帧只收到一部分: 一次把缓冲区扩到能装下整帧，避免随着数据到来反复扩容拷贝
+            buf->EnsureWriteAble(frame_len - buf->ReadAbleSize());
+            return 0;
+        }
+        *frame = std::string_view(buf->ReadAddr() + header_len, body_len);
+        // 先移动读位置再交给上层: 回调里关闭连接时会再处理一次缓冲区里剩下的数据，不能把这一帧再交出去一次
+        buf->MoveReaderOffset(frame_len);
+        return 1;
+    }
+    // 从输入缓冲区里切出所有完整的帧，不完整的留在缓冲区等下次数据到来
+    void OnMessage(const PtrConnection &conn, Buffer *buf)
+    {
+        std::string_view frame;
+        while (buf->ReadAbleSize() > 0)
+        {
+            int ret = NextFrame(buf, &frame);
+            if (ret == 0)
+                return;
+            if (ret < 0)
+            {
+                buf->Clear();
+                return conn->Shutdown();
+            }
+            if (_frame_callback)
+                _frame_callback(conn, frame);
+        }
+    }
+    // 写出一帧的长度头，超过单帧上限或者长度头表示不了时返回 0
+    size_t EncodeHeader(size_t len, char *header) const
+    {
+        size_t header_len = len > _max_frame ? 0 : Header::Encode(len, header);
+        if (header_len == 0)
+            ERR_LOG("FRAME TOO LARGE, LENGTH %zu, MAX %zu", len, _max_frame);
+        return header_len;
+    }
+    // 把一帧编码到 out 中: 多帧先编码到同一个 Buffer，再一次 Send 出去
+    // 帧太大时不编码，返回 false(发出去的话对端要么断开连接，要么把后面的帧都解析错)
+    bool Encode(Buffer *out, const char *data, size_t len) const
+    {
+        char header[Header::MAX_SIZE];
+        size_t header_len = EncodeHeader(len, header);
+        if (header_len == 0)
+            return false;
+        out->WriteAndPush(header, header_len);
+        out->WriteAndPush(data, len);
+        return true;
+    }
+    bool Encode(Buffer *out, std::string_view data) const { return Encode(out, data.data(), data.size()); }
+    // 发送一帧，帧太大时不发送，返回 false
+    bool Send(const PtrConnection &conn, const char *data, size_t len) const
+    {
+        // 在连接所属线程里直接追加到发送缓冲区，两次 Send 在本轮循环结束时一起发出去，不需要额外的缓冲区
+        if (conn->GetLoop()->IsinLoop())
+        {
+            char header[Header::MAX_SIZE];
+            size_t header_len = EncodeHeader(len, header);
+            if (header_len == 0)
+                return false;
+            conn->Send(header, header_len);
+            conn->Send(data, len);
+            return true;
+        }
+        Buffer buf;
+        if (Encode(&buf, data, len) == false)
+            return false;
+        conn->Send(buf.ReadAddr(), buf.ReadAbleSize());
+        return true;
+    }
+    bool Send(const PtrConnection &conn, std::string_view data) const { return Send(conn, data.data(), data.size()); }
+    // 发送一批已经编码好的帧
+    static void SendBatch(const PtrConnection &conn, Buffer &frames)
+    {
+        conn->Send(frames.ReadAddr(), frames.ReadAbleSize());
+        frames.Clear();
+    }
+};
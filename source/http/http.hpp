@@ -3,8 +3,32 @@
 #include <sys/stat.h>
 #include <fstream>
 #include <regex>
+#include <string_view>
+#include <charconv>
+#include <shared_mutex>
+#include <sys/inotify.h>
+#include <dirent.h>
+#include <zlib.h>
+#include <random>
+#include <deque>
 
 #define DEFALT_TIMEOUT 10
+#define HTTP_PIPELINE_DEPTH 64 // 一次最多连续处理的流水线请求数
+#define HTTP_PAUSE_PIPELINE READ_PAUSE_CUSTOM        // 暂停读的原因: 一批流水线请求到了上限，下一轮循环再继续
+#define HTTP_PAUSE_PENDING (READ_PAUSE_CUSTOM << 1)  // 暂停读的原因: 上一个响应还没完成(流式正文 / 协程)
+#define HTTP_BODY_COPY_MAX (16 * 1024) // 正文不超过这个大小时拷贝进发送缓冲区，更大的按引用发送
+#define HTTP_MAX_RANGES 16              // 一个请求最多请求多少段，超过了忽略 Range 返回整个文件
+#define HTTP_GZIP_LEVEL 1               // 动态响应的默认压缩级别
+#define HTTP_GZIP_MIN_LENGTH 1024       // 正文小于这个大小不压缩，压缩省下的字节抵不上开销
+#define HTTP_BODY_WRITER_LIMIT (1024 * 1024) // 流式写入对象缓存的数据超过这个大小时不再可写，连接拉走之后再通知
+#define HTTP_BODY_SPILL_SIZE (1024 * 1024) // 请求正文超过这个大小时写进临时文件
+#define HTTP_BODY_SPILL_DIR "/tmp"        // 请求正文临时文件的默认目录
+#define FILE_CACHE_SIZE (256 * 1024 * 1024)  // 静态文件缓存的总大小上限
+#define FILE_CACHE_MAX_FILE (4 * 1024 * 1024) // 超过这个大小的文件不缓存，用 sendfile 发送
+#define FILE_CACHE_EVICT_SAMPLES 8            // 淘汰时抽查的文件个数，淘汰其中最久没有使用的
+#define FILE_CACHE_GZIP_LEVEL 6               // 缓存的静态文件的压缩级别: 在后台线程里只压缩一次，用比动态响应高的级别
+#define OPEN_FILE_CACHE_MAX 1024              // 每个 loop 缓存的打开文件(包括不存在的路径)个数上限
+#define OPEN_FILE_CACHE_VALID 2               // 打开文件缓存的有效时间(秒)，过期后重新打开检查
 
 // 状态码到状态信息的映射
 std::unordered_map<int, std::string> _statu_msg = {
@@ -239,23 +263,24 @@ public:
     }
     static int HEXTOI(char ch)
     {
-        if (ch > '0' && ch < '9')
+        if (ch >= '0' && ch <= '9')
             return ch - '0';
-        else if (ch > 'a' && ch < 'z')
+        else if (ch >= 'a' && ch <= 'f')
             return ch - 'a' + 10;
-        else if (ch > 'A' && ch < 'Z')
+        else if (ch >= 'A' && ch <= 'F')
             return ch - 'A' + 10;
         return -1;
     }
     // 对 URL 进行解码
-    static std::string UrlDecode(const std::string &url, bool convert_plus_to_space)
+    static std::string UrlDecode(std::string_view url, bool convert_plus_to_space)
     {
         std::string res;
-        for (int i = 0; i < url.size(); i++)
+        res.reserve(url.size());
+        for (size_t i = 0; i < url.size(); i++)
         {
             if (url[i] == '+' && convert_plus_to_space)
                 res += ' ';
-            else if (url[i] == '%')
+            else if (url[i] == '%' && i + 2 < url.size() && HEXTOI(url[i + 1]) >= 0 && HEXTOI(url[i + 2]) >= 0)
             {
                 int v1 = HEXTOI(url[i + 1]);
                 int v2 = HEXTOI(url[i + 2]);
@@ -279,6 +304,155 @@ public:
         }
         return "Unknow";
     }
+    // 状态行中协议版本之后的部分，如 " 200 OK\r\n": 第一次使用时按 _statu_msg 生成整张表，之后直接查表
+    static std::string_view StatusLine(int statu)
+    {
+        static const std::vector<std::string> table = []()
+        {
+            std::vector<std::string> t(600);
+            for (int i = 100; i < 600; i++)
+                t[i] = " " + std::to_string(i) + " " + StatuDesc(i) + "\r\n";
+            return t;
+        }();
+        if (statu < 100 || statu >= 600)
+            statu = 500;
+        return table[statu];
+    }
+    // 当前时间的 HTTP 日期(如 "Sun, 06 Nov 1994 08:49:37 GMT")
+    // 每个线程(也就是每个 EventLoop)缓存一份，一秒内的响应共用，每秒最多格式化一次
+    static std::string_view HttpDate()
+    {
+        thread_local time_t last = 0;
+        thread_local char buf[64];
+        thread_local size_t len = 0;
+        time_t now = time(nullptr);
+        if (now != last)
+        {
+            struct tm tm;
+            gmtime_r(&now, &tm);
+            len = strftime(buf, sizeof(buf), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+            last = now;
+        }
+        return std::string_view(buf, len);
+    }
+    // 这种类型的内容是否值得压缩(文本类); 图片、视频、压缩包等本来就是压缩过的
+    static bool Compressible(std::string_view mime)
+    {
+        mime = mime.substr(0, mime.find(';')); // 去掉 ; charset=utf-8 之类的参数
+        while (!mime.empty() && mime.back() == ' ')
+            mime.remove_suffix(1);
+        if (mime.compare(0, 5, "text/") == 0)
+            return true;
+        return mime == "application/json" || mime == "application/javascript" || mime == "application/xml" ||
+               mime == "image/svg+xml" || mime == "application/xhtml+xml";
+    }
+    // Accept-Encoding 是否接受 gzip: 明确列出的 gzip 以它的 q 值为准，否则看 *
+    static bool AcceptGzip(std::string_view value)
+    {
+        int gzip = -1, star = -1; // -1 没有出现，0 拒绝，1 接受
+        while (value.empty() == false)
+        {
+            size_t comma = value.find(',');
+            std::string_view item = value.substr(0, comma);
+            value = comma == std::string_view::npos ? std::string_view() : value.substr(comma + 1);
+            size_t semi = item.find(';');
+            std::string_view coding = item.substr(0, semi);
+            while (!coding.empty() && (coding.front() == ' ' || coding.front() == '\t'))
+                coding.remove_prefix(1);
+            while (!coding.empty() && (coding.back() == ' ' || coding.back() == '\t'))
+                coding.remove_suffix(1);
+            // q=0 (0.0, 0.00 ...)表示拒绝
+            int accept = 1;
+            if (semi != std::string_view::npos)
+            {
+                std::string_view param = item.substr(semi + 1);
+                size_t q = param.find("q=");
+                if (q != std::string_view::npos)
+                {
+                    std::string_view qval = param.substr(q + 2);
+                    accept = 0;
+                    for (char c : qval)
+                    {
+                        if (c >= '1' && c <= '9')
+                            accept = 1;
+                        else if (c != '0' && c != '.')
+                            break;
+                    }
+                }
+            }
+            auto is = [&coding](const char *name)
+            { return coding.size() == strlen(name) && strncasecmp(coding.data(), name, coding.size()) == 0; };
+            if (is("gzip") || is("x-gzip"))
+                gzip = accept;
+            else if (coding == "*")
+                star = accept;
+        }
+        return gzip >= 0 ? gzip == 1 : star == 1;
+    }
+    // gzip 压缩 data 追加到 out 中，输出一块一块地增长，不用预先估计大小
+    static bool Gzip(std::string_view data, int level, std::string *out)
+    {
+        z_stream zs;
+        memset(&zs, 0, sizeof(zs));
+        // windowBits 15 + 16 表示输出 gzip 格式(带 gzip 头和 CRC)
+        if (deflateInit2(&zs, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+            return false;
+        zs.next_in = (Bytef *)data.data();
+        zs.avail_in = data.size();
+        size_t start = out->size();
+        int ret = Z_OK;
+        while (ret == Z_OK)
+        {
+            size_t used = out->size();
+            out->resize(used + std::max((size_t)16384, data.size() / 4));
+            zs.next_out = (Bytef *)&(*out)[used];
+            zs.avail_out = out->size() - used;
+            ret = deflate(&zs, Z_FINISH);
+            out->resize(out->size() - zs.avail_out);
+        }
+        deflateEnd(&zs);
+        if (ret != Z_STREAM_END)
+        {
+            out->resize(start);
+            return false;
+        }
+        return true;
+    }
+    // 把时间格式化成 HTTP 日期
+    static std::string FormatHttpDate(time_t t)
+    {
+        struct tm tm;
+        gmtime_r(&t, &tm);
+        char buf[64];
+        size_t len = strftime(buf, sizeof(buf), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+        return std::string(buf, len);
+    }
+    // 文件的 ETag: 由 inode、大小和修改时间生成，文件一变就不一样
+    // 刚修改(一秒内)的文件可能在同一秒内再被修改，修改时间分辨不出来，只能给弱 ETag
+    static std::string FileETag(const struct stat &st)
+    {
+        char buf[80];
+        bool weak = st.st_mtime >= time(nullptr) - 1;
+        snprintf(buf, sizeof(buf), "%s\"%lx-%lx-%lx\"", weak ? "W/" : "", (unsigned long)st.st_ino,
+                 (unsigned long)st.st_size, (unsigned long)st.st_mtime);
+        return buf;
+    }
+    // 解析 HTTP 日期(IMF-fixdate 格式，如 "Sun, 06 Nov 1994 08:49:37 GMT")，失败返回 false
+    static bool ParseHttpDate(std::string_view date, time_t *t)
+    {
+        char buf[64];
+        if (date.size() >= sizeof(buf))
+            return false;
+        memcpy(buf, date.data(), date.size());
+        buf[date.size()] = '\0';
+        struct tm tm;
+        memset(&tm, 0, sizeof(tm));
+        const char *end = strptime(buf, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+        if (end == nullptr || *end != '\0')
+            return false;
+        *t = timegm(&tm);
+        return true;
+    }
     // 根据文件后缀名获取文件mime
     static std::string ExtMime(const std::string &filename)
     {
@@ -316,6 +490,33 @@ public:
             return false;
         return S_ISREG(st.st_mode);
     }
+    // 规范化请求路径: 去掉多余的 / 和 . ，处理 .. (调用前已经用 ValidPath 检查过不会越过根目录)
+    // 保留末尾的 / (表示请求的是目录)
+    static std::string NormalizePath(const std::string &path)
+    {
+        std::vector<std::string> subdir;
+        Util::Split(path, "/", &subdir);
+        std::vector<std::string> parts;
+        for (auto &dir : subdir)
+        {
+            if (dir == ".")
+                continue;
+            if (dir == "..")
+            {
+                if (parts.empty() == false)
+                    parts.pop_back();
+                continue;
+            }
+            parts.push_back(std::move(dir));
+        }
+        std::string res;
+        for (auto &part : parts)
+            res += "/" + part;
+        bool is_dir = path.empty() || path.back() == '/' || subdir.back() == "." || subdir.back() == "..";
+        if (res.empty() || is_dir)
+            res += "/";
+        return res;
+    }
     static bool ValidPath(const std::string &path)
     {
         std::vector<std::string> subdir;
@@ -336,19 +537,721 @@ public:
     }
 };
 
+// 打开的文件描述符，最后一个引用释放时关闭
+class FileHandle
+{
+private:
+    int _fd;
+
+public:
+    FileHandle(int fd) : _fd(fd) {}
+    ~FileHandle()
+    {
+        if (_fd >= 0)
+            close(_fd);
+    }
+    int Fd() { return _fd; }
+};
+using PtrFileHandle = std::shared_ptr<FileHandle>;
+
+// 缓存的静态文件: 文件内容和响应要用的头部字段值，生成之后不再修改
+struct CachedFile
+{
+    std::string content;
+    std::string mime;
+    std::string length;              // Content-Length 的值
+    time_t mtime;                    // 文件的修改时间
+    std::string etag;                // ETag 和 Last-Modified 的值
+    std::string last_modified;
+    std::atomic<uint64_t> last_use; // 最近一次使用的时间戳(FileCache 的逻辑时钟)，淘汰时用
+    // gzip 压缩后的版本(第一次需要时在后台生成)，跟着文件一起失效; 只在 FileCache 的锁里读写
+    mutable std::shared_ptr<const CachedFile> gzip;
+    mutable std::atomic<bool> gzip_queued{false}; // 已经交给后台压缩，每个版本的文件只压缩一次
+
+    // 占用的内存(包括压缩版本)
+    size_t Charge() const { return content.size() + (gzip ? gzip->content.size() : 0); }
+};
+using PtrCachedFile = std::shared_ptr<const CachedFile>;
+
+// 静态文件缓存: 所有 loop 共享一份，按 LRU 淘汰，总大小不超过上限
+// 读多写少: 命中只加读锁，更新使用时间戳是原子操作; 只有加载新文件和失效时才加写锁
+// 用 inotify 监控根目录(包括子目录)，文件被修改、删除、移动时把对应的缓存删掉
+class FileCache
+{
+private:
+    size_t _capacity;
+    size_t _max_file;
+    size_t _size;
+    std::atomic<uint64_t> _clock;      // 逻辑时钟，每次使用加一
+    std::atomic<uint64_t> _generation; // 每次失效加一: 读文件期间发生了失效，读到的内容就不放进缓存
+    std::shared_mutex _mutex;
+    std::unordered_map<std::string, std::shared_ptr<CachedFile>> _files;
+    std::minstd_rand _rand;            // 淘汰时随机抽样用，只在持有写锁时使用
+    // inotify 相关，只在监控所在的 loop 线程中访问
+    int _inotify_fd;
+    std::unique_ptr<Channel> _channel;
+    std::unordered_map<int, std::string> _watch_dirs; // 监控描述符 -> 目录路径(以 / 结尾)
+    // 后台压缩线程: 压缩大文件比较慢，不能占住 loop 线程，第一次用到时才启动
+    struct GzipTask
+    {
+        std::string path;
+        PtrCachedFile file;
+        int level;
+    };
+    std::mutex _gzip_mutex;
+    std::condition_variable _gzip_cond;
+    std::deque<GzipTask> _gzip_tasks;
+    std::thread _gzip_thread;
+    bool _gzip_quit;
+
+private:
+    // 后台压缩线程的入口: 依次压缩队列里的文件，析构时退出(没压缩的直接丢掉)
+    void GzipEntry()
+    {
+        std::unique_lock<std::mutex> lock(_gzip_mutex);
+        while (true)
+        {
+            _gzip_cond.wait(lock, [this]()
+                            { return _gzip_quit || _gzip_tasks.empty() == false; });
+            if (_gzip_quit)
+                return;
+            GzipTask task = std::move(_gzip_tasks.front());
+            _gzip_tasks.pop_front();
+            lock.unlock();
+            Compress(task);
+            lock.lock();
+        }
+    }
+    // 压缩一个文件，文件还在缓存中的话把压缩版本挂在它上面，计入总大小
+    void Compress(const GzipTask &task)
+    {
+        const PtrCachedFile &file = task.file;
+        auto compressed = std::make_shared<CachedFile>();
+        if (Util::Gzip(file->content, task.level, &compressed->content) == false)
+            return;
+        compressed->mime = file->mime;
+        compressed->length = std::to_string(compressed->content.size());
+        compressed->mtime = file->mtime;
+        // 不同的编码是不同的表示，ETag 也要不同: 在原文件的 ETag 后面加上 -gzip
+        compressed->etag = file->etag.substr(0, file->etag.size() - 1) + "-gzip\"";
+        compressed->last_modified = file->last_modified;
+        compressed->last_use = 0;
+        std::unique_lock<std::shared_mutex> lock(_mutex);
+        auto it = _files.find(task.path);
+        if (it == _files.end() || it->second != file)
+            return; // 压缩期间文件被淘汰或者失效了
+        file->gzip = compressed;
+        _size += compressed->content.size();
+        Evict();
+    }
+    // 淘汰文件直到总大小不超过上限(调用者持有写锁)
+    // 近似 LRU: 从随机位置开始抽查几个文件，淘汰其中最久没有使用的，不用每次都扫描整个表，写锁持有的时间很短
+    void Evict()
+    {
+        while (_size > _capacity && _files.empty() == false)
+        {
+            size_t buckets = _files.bucket_count();
+            size_t bucket = _rand() % buckets;
+            const std::string *victim = nullptr;
+            uint64_t oldest = 0;
+            int sampled = 0;
+            for (size_t scanned = 0; scanned < buckets && sampled < FILE_CACHE_EVICT_SAMPLES; scanned++)
+            {
+                for (auto it = _files.begin(bucket); it != _files.end(bucket) && sampled < FILE_CACHE_EVICT_SAMPLES; ++it, ++sampled)
+                {
+                    uint64_t last_use = it->second->last_use.load(std::memory_order_relaxed);
+                    if (victim == nullptr || last_use < oldest)
+                    {
+                        victim = &it->first;
+                        oldest = last_use;
+                    }
+                }
+                bucket = (bucket + 1) % buckets;
+            }
+            auto it = _files.find(*victim);
+            _size -= it->second->Charge();
+            _files.erase(it);
+        }
+    }
+    void AddWatch(const std::string &dir)
+    {
+        int wd = inotify_add_watch(_inotify_fd, dir.c_str(),
+                                   IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_ONLYDIR);
+        if (wd < 0)
+        {
+            ERR_LOG("INOTIFY WATCH %s FAILED: %s", dir.c_str(), strerror(errno));
+            return;
+        }
+        _watch_dirs[wd] = dir.back() == '/' ? dir : dir + "/";
+        // inotify 不会递归，子目录要一个个加
+        DIR *dp = opendir(dir.c_str());
+        if (dp == nullptr)
+            return;
+        struct dirent *ent;
+        while ((ent = readdir(dp)) != nullptr)
+        {
+            if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
+                continue;
+            std::string sub = _watch_dirs[wd] + ent->d_name;
+            if (Util::IsDirectory(sub))
+                AddWatch(sub);
+        }
+        closedir(dp);
+    }
+    void HandleEvents()
+    {
+        char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+        while (1)
+        {
+            ssize_t len = read(_inotify_fd, buf, sizeof(buf));
+            if (len <= 0)
+                return;
+            for (char *ptr = buf; ptr < buf + len;)
+            {
+                struct inotify_event *ev = (struct inotify_event *)ptr;
+                ptr += sizeof(struct inotify_event) + ev->len;
+                if (ev->mask & IN_Q_OVERFLOW)
+                {
+                    // 事件太多丢掉了一部分，不知道哪些文件变了，全部失效
+                    Clear();
+                    continue;
+                }
+                auto it = _watch_dirs.find(ev->wd);
+                if (it == _watch_dirs.end())
+                    continue;
+                if (ev->mask & (IN_DELETE_SELF | IN_IGNORED))
+                {
+                    InvalidateDir(it->second);
+                    _watch_dirs.erase(it);
+                    continue;
+                }
+                std::string path = it->second + (ev->len > 0 ? ev->name : "");
+                if ((ev->mask & IN_ISDIR) == 0)
+                {
+                    Invalidate(path);
+                    continue;
+                }
+                // 目录被移走/移进来: 目录下的缓存都可能不对了
+                InvalidateDir(path + "/");
+                if (ev->mask & (IN_CREATE | IN_MOVED_TO))
+                    AddWatch(path);
+            }
+        }
+    }
+
+public:
+    FileCache(size_t capacity = FILE_CACHE_SIZE, size_t max_file = FILE_CACHE_MAX_FILE)
+        : _capacity(capacity), _max_file(max_file), _size(0), _clock(0), _generation(0), _inotify_fd(-1), _gzip_quit(false) {}
+    ~FileCache()
+    {
+        {
+            std::unique_lock<std::mutex> lock(_gzip_mutex);
+            _gzip_quit = true;
+        }
+        _gzip_cond.notify_one();
+        if (_gzip_thread.joinable())
+            _gzip_thread.join();
+        if (_channel)
+            _channel->Remove();
+        if (_inotify_fd >= 0)
+            close(_inotify_fd);
+    }
+    void SetCapacity(size_t capacity, size_t max_file)
+    {
+        std::unique_lock<std::shared_mutex> lock(_mutex);
+        _capacity = capacity;
+        _max_file = max_file;
+        Evict();
+    }
+    // 在 loop 中监控 dir 下的文件变化，要在 loop 所在线程中调用
+    bool Watch(EventLoop *loop, const std::string &dir)
+    {
+        _inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (_inotify_fd < 0)
+        {
+            ERR_LOG("INOTIFY INIT FAILED: %s", strerror(errno));
+            return false;
+        }
+        AddWatch(dir);
+        _channel.reset(new Channel(loop, _inotify_fd));
+        _channel->SetReadCallback(std::bind(&FileCache::HandleEvents, this));
+        _channel->EnableRead();
+        return true;
+    }
+    PtrCachedFile Get(const std::string &path)
+    {
+        std::shared_lock<std::shared_mutex> lock(_mutex);
+        auto it = _files.find(path);
+        if (it == _files.end())
+            return nullptr;
+        it->second->last_use.store(++_clock, std::memory_order_relaxed);
+        return it->second;
+    }
+    // 失效计数: 打开文件之前取一次，之后发生过失效的话，打开的可能已经是旧文件了
+    uint64_t Generation() { return _generation.load(); }
+    // 读取已经打开的文件(st 是它的 fstat 结果，generation 是打开之前的失效计数)放进缓存
+    // 文件太大(应该边读边发)或者读取失败返回 nullptr
+    PtrCachedFile Load(const std::string &path, int fd, const struct stat &st, uint64_t generation)
+    {
+        if (S_ISREG(st.st_mode) == false || (size_t)st.st_size > _max_file)
+            return nullptr;
+        auto cached = std::make_shared<CachedFile>();
+        cached->content.resize(st.st_size);
+        size_t total = 0;
+        while (total < (size_t)st.st_size)
+        {
+            // 描述符可能被多个请求共享，用 pread 不改变文件偏移
+            ssize_t n = pread(fd, &cached->content[total], st.st_size - total, total);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                break;
+            total += n;
+        }
+        cached->content.resize(total);
+        cached->mime = Util::ExtMime(path);
+        cached->length = std::to_string(total);
+        cached->mtime = st.st_mtime;
+        cached->etag = Util::FileETag(st);
+        cached->last_modified = Util::FormatHttpDate(st.st_mtime);
+        cached->last_use = ++_clock;
+        std::unique_lock<std::shared_mutex> lock(_mutex);
+        if (_generation.load() != generation)
+            return cached; // 打开之后文件可能变了，这次照样用，但不缓存
+        auto it = _files.find(path);
+        if (it != _files.end())
+            return it->second; // 其他线程已经加载过了
+        _files[path] = cached;
+        _size += total;
+        Evict();
+        return cached;
+    }
+    // 文件的 gzip 压缩版本: 已经压缩好并且变小了才返回，否则返回 nullptr(先发送原文件)
+    // 第一次用到时交给后台线程压缩，每个版本的文件只压缩一次，压缩好后和文件一起缓存
+    PtrCachedFile Gzip(const std::string &path, const PtrCachedFile &file, int level)
+    {
+        PtrCachedFile gzip;
+        {
+            std::shared_lock<std::shared_mutex> lock(_mutex);
+            gzip = file->gzip;
+        }
+        if (gzip)
+            return gzip->content.size() < file->content.size() ? gzip : nullptr;
+        if (file->gzip_queued.exchange(true) == false)
+        {
+            std::unique_lock<std::mutex> lock(_gzip_mutex);
+            if (_gzip_thread.joinable() == false)
+                _gzip_thread = std::thread(&FileCache::GzipEntry, this);
+            _gzip_tasks.push_back({path, file, level});
+            _gzip_cond.notify_one();
+        }
+        return nullptr;
+    }
+    // 删除一个文件的缓存
+    void Invalidate(const std::string &path)
+    {
+        std::unique_lock<std::shared_mutex> lock(_mutex);
+        _generation++;
+        auto it = _files.find(path);
+        if (it != _files.end())
+        {
+            _size -= it->second->Charge();
+            _files.erase(it);
+        }
+    }
+    // 删除一个目录(以 / 结尾)下所有文件的缓存
+    void InvalidateDir(const std::string &dir)
+    {
+        std::unique_lock<std::shared_mutex> lock(_mutex);
+        _generation++;
+        for (auto it = _files.begin(); it != _files.end();)
+        {
+            if (it->first.compare(0, dir.size(), dir) == 0)
+            {
+                _size -= it->second->Charge();
+                it = _files.erase(it);
+            }
+            else
+                ++it;
+        }
+    }
+    void Clear()
+    {
+        std::unique_lock<std::shared_mutex> lock(_mutex);
+        _generation++;
+        _files.clear();
+        _size = 0;
+    }
+    size_t Size()
+    {
+        std::shared_lock<std::shared_mutex> lock(_mutex);
+        return _size;
+    }
+};
+
+// 打开文件的查找结果
+struct OpenFileInfo
+{
+    PtrFileHandle file; // 打开的描述符(只有普通文件才有)，多个请求共享，读的时候要用 pread
+    struct stat st;
+    int err;             // 打开失败时的 errno，0 表示成功
+    time_t expire;       // 过期时间
+    uint64_t generation; // 打开时文件缓存(FileCache)的失效计数
+    std::string etag;    // 普通文件的 ETag 和 Last-Modified 的值
+    std::string last_modified;
+};
+
+// 打开文件缓存(类似 nginx 的 open_file_cache): 缓存打开的描述符、stat 结果，以及不存在的路径
+// 每个 loop 线程一份(见 Local)，不需要加锁; 过期之前同一个路径不再调用 open/fstat，
+// 扫描不存在路径的请求也不会每次都进内核
+// 根目录下的文件有变化时(FileCache 的失效计数变了)所有结果都作废，重新打开
+class OpenFileCache
+{
+private:
+    size_t _max;
+    int _valid;
+    time_t _last_sweep;
+    std::unordered_map<std::string, OpenFileInfo> _files;
+
+private:
+    // 清掉过期的结果，关闭不再使用的描述符(正在发送的文件由发送链持有，发完才关闭)
+    void Sweep(time_t now)
+    {
+        _last_sweep = now;
+        for (auto it = _files.begin(); it != _files.end();)
+        {
+            if (it->second.expire <= now)
+                it = _files.erase(it);
+            else
+                ++it;
+        }
+    }
+
+public:
+    OpenFileCache(size_t max = OPEN_FILE_CACHE_MAX, int valid = OPEN_FILE_CACHE_VALID) : _max(max), _valid(valid), _last_sweep(0) {}
+    // 当前线程的缓存，第一次使用时按参数创建
+    static OpenFileCache &Local(size_t max, int valid)
+    {
+        static thread_local OpenFileCache cache(max, valid);
+        return cache;
+    }
+    // 查找 path: 返回值的 err 为 0 时，file 和 st 有效; generation 是文件缓存当前的失效计数
+    const OpenFileInfo &Open(const std::string &path, uint64_t generation)
+    {
+        time_t now = time(nullptr);
+        // 每秒最多清理一次，过期的描述符不会一直占着
+        if (now != _last_sweep)
+            Sweep(now);
+        auto it = _files.find(path);
+        if (it != _files.end() && it->second.expire > now && it->second.generation == generation)
+            return it->second;
+        // 缓存满了，随便淘汰一个
+        if (it == _files.end() && _files.size() >= _max)
+            _files.erase(_files.begin());
+        OpenFileInfo &info = _files[path];
+        info.file.reset();
+        info.err = 0;
+        info.expire = now + _valid;
+        info.generation = generation;
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC | O_NONBLOCK);
+        if (fd < 0)
+        {
+            info.err = errno;
+            return info;
+        }
+        PtrFileHandle file = std::make_shared<FileHandle>(fd);
+        if (fstat(fd, &info.st) < 0)
+        {
+            info.err = errno;
+            return info;
+        }
+        // 目录等只记录 stat 结果，不占着描述符
+        if (S_ISREG(info.st.st_mode))
+        {
+            info.file = file;
+            info.etag = Util::FileETag(info.st);
+            info.last_modified = Util::FormatHttpDate(info.st.st_mtime);
+        }
+        return info;
+    }
+    size_t Size() { return _files.size(); }
+};
+
+// 常用的头部字段: 解析时识别一次，之后按编号比较，不用再逐字符比较字段名
+typedef enum
+{
+    HDR_UNKNOWN = 0,
+    HDR_HOST,
+    HDR_CONNECTION,
+    HDR_CONTENT_LENGTH,
+    HDR_CONTENT_TYPE,
+    HDR_CONTENT_ENCODING,
+    HDR_CONTENT_RANGE,
+    HDR_TRANSFER_ENCODING,
+    HDR_EXPECT,
+    HDR_ACCEPT,
+    HDR_ACCEPT_ENCODING,
+    HDR_ACCEPT_RANGES,
+    HDR_RANGE,
+    HDR_IF_RANGE,
+    HDR_IF_NONE_MATCH,
+    HDR_IF_MODIFIED_SINCE,
+    HDR_ETAG,
+    HDR_LAST_MODIFIED,
+    HDR_LOCATION,
+    HDR_DATE,
+    HDR_SERVER,
+    HDR_USER_AGENT,
+    HDR_COOKIE,
+    HDR_UPGRADE,
+    HDR_VARY,
+    HDR_COUNT
+} HttpHeader;
+
+// 头部字段的集合: 请求一般只有 5~15 个头部，用数组顺序查找比哈希表更快，也不用每个字段分配一次内存
+// 字段名和值都拷贝到同一块 _raw 内存里，数组里只记录偏移，取出来是指向 _raw 的 string_view
+// 字段名不区分大小写; Clear 之后内存保留，同一个连接上的下一个请求可以直接复用
+class HttpHeaders
+{
+private:
+    struct Field
+    {
+        HttpHeader id;
+        uint32_t key_off;
+        uint32_t key_len;
+        uint32_t val_off;
+        uint32_t val_len;
+    };
+    std::string _raw;
+    std::vector<Field> _fields;
+
+    static const std::string_view *Names()
+    {
+        static const std::string_view names[HDR_COUNT] = {
+            "", "Host", "Connection", "Content-Length", "Content-Type", "Content-Encoding", "Content-Range",
+            "Transfer-Encoding", "Expect", "Accept", "Accept-Encoding", "Accept-Ranges", "Range", "If-Range",
+            "If-None-Match", "If-Modified-Since", "ETag", "Last-Modified", "Location", "Date", "Server",
+            "User-Agent", "Cookie", "Upgrade", "Vary"};
+        return names;
+    }
+    std::string_view View(uint32_t off, uint32_t len) const { return std::string_view(_raw.data() + off, len); }
+    uint32_t Append(std::string_view data)
+    {
+        uint32_t off = _raw.size();
+        _raw.append(data.data(), data.size());
+        return off;
+    }
+    const Field *Find(HttpHeader id, std::string_view key) const
+    {
+        for (const Field &f : _fields)
+        {
+            if (f.id != id)
+                continue;
+            if (id != HDR_UNKNOWN || EqualsIgnoreCase(View(f.key_off, f.key_len), key))
+                return &f;
+        }
+        return nullptr;
+    }
+
+public:
+    static bool EqualsIgnoreCase(std::string_view a, std::string_view b)
+    {
+        return a.size() == b.size() && strncasecmp(a.data(), b.data(), a.size()) == 0;
+    }
+    // 字段名对应的编号，不是常用字段返回 HDR_UNKNOWN
+    static HttpHeader Lookup(std::string_view key)
+    {
+        const std::string_view *names = Names();
+        for (int i = 1; i < HDR_COUNT; i++)
+        {
+            if (EqualsIgnoreCase(names[i], key))
+                return (HttpHeader)i;
+        }
+        return HDR_UNKNOWN;
+    }
+    static std::string_view Name(HttpHeader id) { return Names()[id]; }
+    // 追加一个字段(不检查是否已经存在，解析请求时使用)
+    void Add(std::string_view key, std::string_view val) { Add(Lookup(key), key, val); }
+    // 已经查过字段编号时用这个，省掉一次查找
+    void Add(HttpHeader id, std::string_view key, std::string_view val)
+    {
+        uint32_t key_off = Append(key);
+        uint32_t val_off = Append(val);
+        _fields.push_back(Field{id, key_off, (uint32_t)key.size(), val_off, (uint32_t)val.size()});
+    }
+    // 设置字段: 已经存在则覆盖
+    void Set(std::string_view key, std::string_view val)
+    {
+        HttpHeader id = Lookup(key);
+        Field *f = const_cast<Field *>(Find(id, key));
+        if (f == nullptr)
+            return Add(key, val);
+        f->val_off = Append(val);
+        f->val_len = val.size();
+    }
+    void Set(HttpHeader id, std::string_view val) { Set(Name(id), val); }
+    bool Has(HttpHeader id) const { return Find(id, "") != nullptr; }
+    bool Has(std::string_view key) const { return Find(Lookup(key), key) != nullptr; }
+    // 获取字段的值，不存在返回空; 返回值指向内部内存，下一次修改之前有效
+    std::string_view Get(HttpHeader id) const
+    {
+        const Field *f = Find(id, "");
+        return f ? View(f->val_off, f->val_len) : std::string_view();
+    }
+    std::string_view Get(std::string_view key) const
+    {
+        const Field *f = Find(Lookup(key), key);
+        return f ? View(f->val_off, f->val_len) : std::string_view();
+    }
+    void Erase(std::string_view key)
+    {
+        HttpHeader id = Lookup(key);
+        const Field *f = Find(id, key);
+        if (f)
+            _fields.erase(_fields.begin() + (f - _fields.data()));
+    }
+    size_t Size() const { return _fields.size(); }
+    void Clear()
+    {
+        _raw.clear();
+        _fields.clear();
+    }
+    // 按加入的顺序遍历: for (auto it : headers) 得到 it.first(字段名) / it.second(值)
+    class Iterator
+    {
+    private:
+        const HttpHeaders *_headers;
+        size_t _idx;
+
+    public:
+        Iterator(const HttpHeaders *headers, size_t idx) : _headers(headers), _idx(idx) {}
+        std::pair<std::string_view, std::string_view> operator*() const
+        {
+            const Field &f = _headers->_fields[_idx];
+            return std::make_pair(_headers->View(f.key_off, f.key_len), _headers->View(f.val_off, f.val_len));
+        }
+        Iterator &operator++()
+        {
+            _idx++;
+            return *this;
+        }
+        bool operator!=(const Iterator &other) const { return _idx != other._idx; }
+    };
+    Iterator begin() const { return Iterator(this, 0); }
+    Iterator end() const { return Iterator(this, _fields.size()); }
+};
+
+// 落盘的请求正文: 正文超过阈值时写进临时文件，而不是全部放在内存里
+// 对象释放时删除临时文件; 用 MoveTo 移走之后就不再删除
+class HttpBodyFile
+{
+private:
+    int _fd;
+    std::string _path;
+    size_t _size;
+
+public:
+    HttpBodyFile() : _fd(-1), _size(0) {}
+    ~HttpBodyFile()
+    {
+        if (_fd >= 0)
+            close(_fd);
+        if (_path.empty() == false)
+            unlink(_path.c_str());
+    }
+    // 在 dir 目录下创建临时文件
+    bool Create(const std::string &dir)
+    {
+        std::string path = dir + "/http-body-XXXXXX";
+        _fd = mkostemp(&path[0], O_CLOEXEC);
+        if (_fd < 0)
+        {
+            ERR_LOG("CREATE BODY FILE IN %s FAILED: %s", dir.c_str(), strerror(errno));
+            return false;
+        }
+        _path = path;
+        return true;
+    }
+    bool Write(const char *data, size_t len)
+    {
+        while (len > 0)
+        {
+            ssize_t n = write(_fd, data, len);
+            if (n < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                ERR_LOG("WRITE BODY FILE %s FAILED: %s", _path.c_str(), strerror(errno));
+                return false;
+            }
+            data += n;
+            len -= n;
+            _size += n;
+        }
+        return true;
+    }
+    int Fd() const { return _fd; }
+    const std::string &Path() const { return _path; }
+    size_t Size() const { return _size; }
+    // 把正文文件移动到 target: 同一个文件系统直接改名，不用再写一遍; 跨文件系统时退回到拷贝
+    bool MoveTo(const std::string &target)
+    {
+        if (_path.empty())
+            return false;
+        fchmod(_fd, 0644); // 临时文件创建时只有自己可读写，移走之后按普通文件的权限
+        if (rename(_path.c_str(), target.c_str()) == 0)
+        {
+            _path.clear();
+            return true;
+        }
+        if (errno != EXDEV)
+        {
+            ERR_LOG("MOVE BODY FILE TO %s FAILED: %s", target.c_str(), strerror(errno));
+            return false;
+        }
+        int out = open(target.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (out < 0)
+        {
+            ERR_LOG("OPEN %s FAILED: %s", target.c_str(), strerror(errno));
+            return false;
+        }
+        off_t offset = 0;
+        while ((size_t)offset < _size)
+        {
+            ssize_t n = sendfile(out, _fd, &offset, _size - offset);
+            if (n <= 0)
+            {
+                if (n < 0 && errno == EINTR)
+                    continue;
+                ERR_LOG("COPY BODY FILE TO %s FAILED: %s", target.c_str(), strerror(errno));
+                close(out);
+                unlink(target.c_str());
+                return false;
+            }
+        }
+        close(out);
+        return true;
+    }
+};
+using PtrBodyFile = std::shared_ptr<HttpBodyFile>;
+
 class HttpRequest
 {
 public:
     std::string _method;                                   // 请求方法
     std::string _path;                                     // 资源路径
     std::string _version;                                  // 协议版本
-    std::string _body;                                     // 请求正文
-    std::smatch _matches;                                  // 存储资源路径的正则提取后的数据(比如一个要请求的资源的文件名...)
-    std::unordered_map<std::string, std::string> _headers; // 头部字段
+    std::string _body;                                     // 请求正文(正文落盘或者流式接收时为空)
+    PtrBodyFile _body_file;                                // 超过阈值落盘的请求正文，没有落盘时为空
+    size_t _body_size;                                     // 收到的正文大小
+    std::smatch _matches;                                  // 正则路由(GetRegex 等)提取出的数据
+    std::vector<std::pair<std::string_view, std::string_view>> _route_params; // 路由里 :name / *name 匹配到的路径片段(指向 _path)
+    HttpHeaders _headers;                                  // 头部字段
+    HttpHeaders _trailers;                                 // 分块传输的正文后面跟着的 trailer 字段
     std::unordered_map<std::string, std::string> _params;  // 查询字符串
 public:
     HttpRequest()
-        : _version("Http/1.1")
+        : _version("HTTP/1.1"), _body_size(0)
     {
     }
     // 可以实现复用 HttpRequest 对象
@@ -356,34 +1259,38 @@ public:
     {
         _method.clear();
         _path.clear();
-        _version.clear();
+        _version = "HTTP/1.1";
         _body.clear();
+        _body_file.reset();
+        _body_size = 0;
         std::smatch match;
         _matches.swap(match);
-        _headers.clear();
+        _route_params.clear();
+        _headers.Clear();
+        _trailers.Clear();
         _params.clear();
     }
-    void SetHeader(const std::string &key, const std::string &val)
+    void SetHeader(std::string_view key, std::string_view val)
     {
         // 如果原有键值对存在的话，会覆盖
-        _headers[key] = val;
+        _headers.Set(key, val);
     }
-    bool HasHeader(const std::string &key)
+    bool HasHeader(std::string_view key) const { return _headers.Has(key); }
+    bool HasHeader(HttpHeader id) const { return _headers.Has(id); }
+    // 返回的值指向请求内部的内存，请求被重置之前有效
+    std::string_view GetHeader(std::string_view key) const { return _headers.Get(key); }
+    std::string_view GetHeader(HttpHeader id) const { return _headers.Get(id); }
+
+    // 路由参数: 注册 "/user/:id" 时，请求 "/user/42" 的 GetRouteParam("id") 为 "42"
+    std::string_view GetRouteParam(std::string_view name) const
     {
-        auto it = _headers.find(key);
-        if (it == _headers.end())
+        for (auto &it : _route_params)
         {
-            return false;
+            if (it.first == name)
+                return it.second;
         }
-        return true;
+        return std::string_view();
     }
-    std::string GetHeader(const std::string &key)
-    {
-        if (HasHeader(key) == false)
-            return "";
-        return _headers[key];
-    }
-
     void SetParam(const std::string &key, const std::string &val)
     {
         _params[key] = val;
@@ -403,24 +1310,164 @@ public:
             return "";
         return _params[key];
     }
-    size_t ContentLength()
+    // 解析请求头部时已经检查过格式，这里不再检查
+    size_t ContentLength() const
     {
-        int ret = HasHeader("Content-Length");
-        if (ret == false)
-            return 0;
-        std::string clen = GetHeader("Content-Length");
-        return std::stol(clen);
+        std::string_view clen = GetHeader(HDR_CONTENT_LENGTH);
+        size_t len = 0;
+        std::from_chars(clen.data(), clen.data() + clen.size(), len);
+        return len;
     }
     // 判断是否是短连接, 如果是: 返回true , 如果是长连接: 返回false
-    bool Close()
+    bool Close() const
+    {
+        // HTTP/1.1 默认是长连接，Connection: close 才关闭; HTTP/1.0 默认是短连接，Connection: keep-alive 才保持
+        std::string_view conn = GetHeader(HDR_CONNECTION);
+        if (_version == "HTTP/1.0")
+            return HttpHeaders::EqualsIgnoreCase(conn, "keep-alive") == false;
+        return HttpHeaders::EqualsIgnoreCase(conn, "close");
+    }
+};
+
+class HttpResponse;
+// 正文生产者: 和 Connection 的数据生产者一样，每次往 Buffer 里写下一块正文，返回 false 表示正文已经全部写完
+using HttpBodyProducer = std::function<bool(Buffer *)>;
+// 分块传输的正文结束时调用，填写跟在最后一块后面的 trailer 头部字段
+using HttpTrailerCallback = std::function<void(HttpHeaders *)>;
+
+// 流式正文的写入对象: 业务处理函数把它保存下来，之后可以在任意线程里一块一块地写正文，最后 End 结束
+// 写入的数据先缓存在这里，套接字可写时由连接拉走; 缓存超过 HTTP_BODY_WRITER_LIMIT 后 Writable 返回 false，
+// 写入方应该停下来，等连接拉走数据后调用 SetWritableCallback 设置的回调(在连接的 loop 线程中)再继续写
+class HttpBodyWriter
+{
+private:
+    std::mutex _mutex;
+    Buffer _data;
+    bool _ended;
+    HttpHeaders _trailers;
+    bool _attached;                 // 响应是否已经开始发送
+    bool _no_body;                  // 响应不发送正文(HEAD 请求)，写入直接拒绝
+    bool _full;                     // 缓存超过了上限，连接拉走数据后要通知写入方
+    std::function<void()> _writable;
+    std::weak_ptr<Connection> _conn; // 有新数据时通知连接继续拉取
+
+private:
+    void Notify()
+    {
+        PtrConnection conn = _conn.lock();
+        if (conn)
+            conn->ResumeProducer();
+    }
+
+public:
+    HttpBodyWriter() : _ended(false), _attached(false), _no_body(false), _full(false) {}
+    // 写入一块正文，连接已经断开、已经 End 或者响应没有正文时返回 false
+    bool Write(std::string_view data)
     {
-        // 请求报头中有个 Connnection，如果值为 "keep-alive"则为长连接
-        if (HasHeader("Connection") == true && GetHeader("Connection") == "keep-alive")
         {
-            return false;
+            std::unique_lock<std::mutex> lock(_mutex);
+            if (_ended || _no_body || (_attached && _conn.expired()))
+                return false;
+            _data.WriteAndPush(data.data(), data.size());
+            if (_data.ReadAbleSize() >= HTTP_BODY_WRITER_LIMIT)
+                _full = true;
         }
+        Notify();
         return true;
     }
+    // 现在是否应该继续写: 缓存没有超过上限，并且写入不会被拒绝
+    bool Writable()
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        if (_ended || _no_body || (_attached && _conn.expired()))
+            return false;
+        return _data.ReadAbleSize() < HTTP_BODY_WRITER_LIMIT;
+    }
+    // 缓存超过上限之后，连接把数据拉走时调用(在连接的 loop 线程中)
+    void SetWritableCallback(const std::function<void()> &cb)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _writable = cb;
+    }
+    // 正文结束，可以带上 trailer 头部字段(只有分块传输时才会发送)
+    void End(const HttpHeaders &trailers = HttpHeaders())
+    {
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            if (_ended)
+                return;
+            _ended = true;
+            _trailers = trailers;
+        }
+        Notify();
+    }
+    // 还没有发出去的数据量
+    size_t Pending()
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        return _data.ReadAbleSize();
+    }
+    // 以下由服务器在连接的 loop 线程中调用
+    void Attach(const PtrConnection &conn)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _attached = true;
+        _conn = conn;
+    }
+    // 响应不发送正文(HEAD 请求): 丢掉已经写入的数据，之后的写入都拒绝
+    void Discard()
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _no_body = true;
+        _data.Clear();
+    }
+    // 作为正文生产者: 把已经写入的数据交给连接，End 之后数据取完返回 false
+    bool Produce(Buffer *buf)
+    {
+        std::function<void()> writable;
+        bool more;
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            buf->WriteBufferAndPush(_data);
+            _data.Clear();
+            if (_full)
+            {
+                _full = false;
+                writable = _writable;
+            }
+            more = _ended == false;
+        }
+        // 回调里可能接着 Write，不能持有锁
+        if (writable)
+            writable();
+        return more;
+    }
+    void TakeTrailers(HttpHeaders *trailers)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        *trailers = std::move(_trailers);
+    }
+};
+using PtrBodyWriter = std::shared_ptr<HttpBodyWriter>;
+// 业务处理回调函数，并生成响应
+using HttpHandler = std::function<void(const HttpRequest &req, HttpResponse *resp)>;
+#ifdef HAS_COROUTINE
+// 协程版业务处理函数: 可以在里面 co_await 定时器、其他连接等，协程结束时响应才会被发送
+using HttpAsyncHandler = std::function<CoTask(const HttpRequest &req, HttpResponse *resp)>;
+#endif
+// 流式接收正文: 正文每收到一块调用一次，最后用空的 data 调用一次表示正文结束; 返回 false 表示出错，不再接收
+using HttpBodyReader = std::function<bool(std::string_view data)>;
+// 请求头部收完、正文还没有开始接收时调用，返回这个请求的正文接收函数(可以在里面保存状态，比如打开的目标文件)
+// 返回空函数表示拒绝这个请求，响应的状态码在 resp 里设置(默认 400)，带 Expect: 100-continue 的客户端不会再发送正文
+using HttpBodyOpener = std::function<HttpBodyReader(const HttpRequest &req, HttpResponse *resp)>;
+
+// 范围请求(206)要发送的一段正文，offset 是相对整个正文的位置
+// head 是多段响应(multipart/byteranges)里这一段前面的分隔行和头部，单段响应为空
+struct HttpBodyRange
+{
+    std::string head;
+    size_t offset;
+    size_t len;
 };
 
 class HttpResponse
@@ -430,51 +1477,111 @@ public:
     bool _redirect_flag;                                   // 是否重定向标志
     std::string _body;                                     // 正文部分
     std::string _redirect_url;                             // 重定向的 url
-    std::unordered_map<std::string, std::string> _headers; // 相应报头
+    HttpHeaders _headers;                                  // 相应报头
+    std::shared_ptr<const void> _shared_holder;            // 共享正文的所有者(比如文件缓存)，设置了共享正文时 _body 不用
+    std::string_view _shared_body;                         // 共享正文，直接引用，发送时不拷贝
+    HttpBodyProducer _stream;                              // 流式正文: 发送完头部后边生产边发送
+    HttpTrailerCallback _trailer;                          // 分块传输的流式正文结束时填写 trailer
+    PtrBodyWriter _writer;                                 // 流式正文来自写入对象时，发送时要把连接告诉它
+    PtrFileHandle _file;                                   // 文件正文: 文件的一段，发送完头部后用 sendfile 发送
+    off_t _file_offset;
+    size_t _file_len;
+    std::vector<HttpBodyRange> _ranges;                    // 不为空时只发送正文的这几段(206)
+    std::string _ranges_tail;                              // 多段响应最后的结束分隔行
+#ifdef HAS_COROUTINE
+    const HttpAsyncHandler *_async_handler; // 路由命中的是协程处理函数时，由服务器在路由结束后启动它
+#endif
 
 public:
     // 默认状态为 200
-    HttpResponse() : _redirect_flag(false), _statu(200) {}
-    HttpResponse(int statu) : _redirect_flag(false), _statu(statu) {}
+    HttpResponse() : _redirect_flag(false), _statu(200), _file_offset(0), _file_len(0)
+    {
+#ifdef HAS_COROUTINE
+        _async_handler = nullptr;
+#endif
+    }
+    HttpResponse(int statu) : _redirect_flag(false), _statu(statu), _file_offset(0), _file_len(0)
+    {
+#ifdef HAS_COROUTINE
+        _async_handler = nullptr;
+#endif
+    }
     void ReSet()
     {
         _statu = 200;
         _redirect_flag = false;
         _body.clear();
         _redirect_url.clear();
-        _headers.clear();
+        _headers.Clear();
+        _shared_holder.reset();
+        _shared_body = std::string_view();
+        _stream = nullptr;
+        _trailer = nullptr;
+        _writer.reset();
+        _file.reset();
+        _file_offset = 0;
+        _file_len = 0;
+        _ranges.clear();
+        _ranges_tail.clear();
+#ifdef HAS_COROUTINE
+        _async_handler = nullptr;
+#endif
     }
     // 插入头部字段
-    void SetHeader(const std::string &key, const std::string &val)
+    void SetHeader(std::string_view key, std::string_view val) { _headers.Set(key, val); }
+    void SetHeader(HttpHeader id, std::string_view val) { _headers.Set(id, val); }
+    // 判断是否存在指定头部字段
+    bool HasHeader(std::string_view key) const { return _headers.Has(key); }
+    bool HasHeader(HttpHeader id) const { return _headers.Has(id); }
+    // 获取指定头部字段的值
+    std::string_view GetHeader(std::string_view key) const { return _headers.Get(key); }
+    std::string_view GetHeader(HttpHeader id) const { return _headers.Get(id); }
+    // 设置正文
+    void SetContent(const std::string &body, const std::string &type = "text/html")
     {
-        _headers[key] = val;
+        _body = body;
+        SetHeader(HDR_CONTENT_TYPE, type);
     }
-    // 判断是否存在指定头部字段
-    bool HasHeader(const std::string &key)
+    // 设置共享正文: holder 持有 body 指向的数据，发送完之前不会释放，正文不会被拷贝
+    void SetSharedContent(std::shared_ptr<const void> holder, std::string_view body, std::string_view type)
     {
-        auto it = _headers.find(key);
-        if (it == _headers.end())
-        {
-            return false;
-        }
-        return true;
+        _shared_holder = std::move(holder);
+        _shared_body = body;
+        SetHeader(HDR_CONTENT_TYPE, type);
     }
-    // 获取指定头部字段的值
-    std::string GetHeader(const std::string &key)
+    // 设置流式正文: 发送完头部之后由 producer 一块一块地生产，length 是正文总长度
+    void SetStream(const HttpBodyProducer &producer, size_t length)
     {
-        auto it = _headers.find(key);
-        if (it == _headers.end())
-        {
-            return "";
-        }
-        return it->second;
+        _stream = producer;
+        SetHeader(HDR_CONTENT_LENGTH, std::to_string(length));
     }
-    // 设置正文
-    void SetContent(const std::string &body, const std::string &type = "text/html")
+    // 设置长度未知的流式正文: 用分块传输(Transfer-Encoding: chunked)发送，套接字可写时才向 producer 要下一块
+    // producer 暂时没有数据时可以返回 true 但不写入，有数据后调用连接的 ResumeProducer 继续
+    // trailer 不为空时在正文结束后调用，填写跟在最后一块后面的头部字段
+    void SetStream(const HttpBodyProducer &producer, const HttpTrailerCallback &trailer = nullptr)
     {
-        _body = body;
-        SetHeader("Content-Type", type);
+        _stream = producer;
+        _trailer = trailer;
+        _headers.Erase("Content-Length");
+    }
+    // 设置长度未知的流式正文，返回写入对象: 正文由业务自己在之后(任意线程)写入，End 时结束
+    PtrBodyWriter SetStreamWriter()
+    {
+        _writer = std::make_shared<HttpBodyWriter>();
+        SetStream(std::bind(&HttpBodyWriter::Produce, _writer, std::placeholders::_1),
+                  std::bind(&HttpBodyWriter::TakeTrailers, _writer, std::placeholders::_1));
+        return _writer;
     }
+    // 设置文件正文: 文件从 offset 开始的 len 字节，不读进内存，由连接用 sendfile 直接发送
+    void SetFileContent(const PtrFileHandle &file, off_t offset, size_t len, std::string_view type)
+    {
+        _file = file;
+        _file_offset = offset;
+        _file_len = len;
+        SetHeader(HDR_CONTENT_LENGTH, std::to_string(len));
+        SetHeader(HDR_CONTENT_TYPE, type);
+    }
+    std::string_view Body() const { return _shared_holder ? _shared_body : std::string_view(_body); }
     // 设置重定向
     void SetRedirect(const std::string &url, int statu = 302)
     {
@@ -483,10 +1590,10 @@ public:
         _redirect_url = url;
     }
     // 判断是否是短链接
-    bool Close()
+    bool Close() const
     {
         // 没有Connection字段，或者有Connection但是值是close，则都是短链接，否则就是长连接
-        if (HasHeader("Connection") == true && GetHeader("Connection") == "keep-alive")
+        if (HttpHeaders::EqualsIgnoreCase(GetHeader(HDR_CONNECTION), "keep-alive"))
         {
             return false;
         }
@@ -494,6 +1601,14 @@ public:
     }
 };
 
+// 请求正文的接收设置，HttpServer 里只有一份，所有连接的上下文共享
+struct HttpBodyConfig
+{
+    size_t spill_size;     // 正文超过这个大小时写进临时文件，0 表示都放在内存里
+    std::string spill_dir; // 临时文件所在的目录
+    size_t max_size;       // 正文大小上限，超过返回 413，0 表示不限制
+};
+
 typedef enum
 {
     RECV_HTTP_ERROR,
@@ -503,221 +1618,596 @@ typedef enum
     RECV_HTTP_OVER
 } HttpRecvStatu;
 
-#define MAX_LINE 8192
+// 分块传输(chunked)的请求正文的解析阶段
+typedef enum
+{
+    RECV_CHUNK_SIZE,     // 块大小行
+    RECV_CHUNK_DATA,     // 块数据
+    RECV_CHUNK_DATA_END, // 块数据后面的 \r\n
+    RECV_CHUNK_TRAILER   // 最后一块后面的 trailer 字段和空行
+} HttpChunkStatu;
+
+#define MAX_LINE 8192            // 请求行 / 单个头部行的长度上限
+#define MAX_HEADER_SIZE 65536    // 整个头部(请求行 + 所有头部行)的大小上限
+#define MAX_HEADER_COUNT 100     // 头部字段个数上限
 
 // 功能: 1. 接收并解析 Http 请求
 //       2. 当接受的请求部分不完整时，保存请求的上下文，使后续接受的剩余部分可以衔接上
+// 解析直接在连接的输入缓冲区上进行: 按行查找换行符，行内用 string_view 切分，不构造临时 string 和正则
 class HttpContext
 {
 private:
     int _resp_statu;           // 响应状态码
     HttpRecvStatu _recv_statu; // 当前接收及解析的阶段状态
     HttpRequest _request;      // 已经解析得到的请求信息
+    HttpResponse _response;    // 当前请求的响应(放在上下文里，异步处理期间也不会失效)
+    bool _pending;             // 当前请求正在被协程异步处理，还没有响应
+    size_t _scanned;           // 当前行已经查找过换行符的长度，数据不完整时下次从这里接着找
+    size_t _head_size;         // 已经解析的头部大小
+    size_t _head_count;        // 已经解析的头部字段个数
+    const HttpBodyConfig *_body_config; // 正文的接收设置，为空时正文都放在内存里
+    HttpBodyReader _reader;    // 流式接收正文的函数，为空时正文放在内存里或者落盘
+    bool _body_begun;          // 已经确定了正文怎么接收(BeginBody)，之后才开始接收正文
+    bool _chunked;             // 正文是分块传输的
+    HttpChunkStatu _chunk_statu; // 分块正文的解析阶段
+    size_t _chunk_left;        // 当前块还没有收到的大小
+    size_t _content_length;    // Content-Length 的值
 
 private:
+    // 从缓冲区里取出一行(不包含行尾的 \r\n)，返回 1 表示取到了，0 表示这一行还不完整，-1 表示超过长度上限
+    // line 直接指向缓冲区里的数据，在下一次往缓冲区写数据之前有效
+    int NextLine(Buffer *buf, std::string_view *line)
+    {
+        size_t size = buf->ReadAbleSize();
+        const char *data = buf->ReadAddr();
+        const char *pos = (const char *)memchr(data + _scanned, '\n', size - _scanned);
+        if (pos == nullptr)
+        {
+            _scanned = size;
+            return size > MAX_LINE ? -1 : 0;
+        }
+        size_t len = pos - data;
+        if (len > MAX_LINE)
+            return -1;
+        buf->MoveReaderOffset(len + 1);
+        _scanned = 0;
+        _head_size += len + 1;
+        if (len > 0 && data[len - 1] == '\r')
+            len--;
+        *line = std::string_view(data, len);
+        return 1;
+    }
+    // 方法名、头部字段名只能由 token 字符组成(RFC 9110)
+    static bool IsToken(char ch)
+    {
+        return isalnum((unsigned char)ch) || (ch != '\0' && strchr("!#$%&'*+-.^_`|~", ch) != nullptr);
+    }
     // 接收并解析请求行, 数据在 Connection的 Buffer 里面
     bool RecvHttpLine(Buffer *buf)
     {
         if (_recv_statu != RECV_HTTP_LINE)
             return false;
-        std::string line = buf->GetLineAndPop();
-        // 没有找到换行
-        if (line.size() == 0)
-        {
-            // 但是 buf 的数据超过了一行最大数据，则认为出问题了
-            if (buf->ReadAbleSize() > MAX_LINE)
-            {
-                _recv_statu = RECV_HTTP_ERROR; // 设置错误状态
-                _resp_statu = 414;             // URI TOO LONG
-                return false;
-            }
-            return true;
-        }
-        // 虽然接受到了一行，但是这一行的数据也不符合要求
-        else if (line.size() > MAX_LINE)
+        std::string_view line;
+        while (1)
         {
-            _recv_statu = RECV_HTTP_ERROR;
-            _resp_statu = 414;
-            return false;
+            int ret = NextLine(buf, &line);
+            if (ret < 0)
+                return SetError(414); // URI TOO LONG
+            if (ret == 0)
+                return true;
+            // 请求之间允许有多余的空行(RFC 9112 2.2)
+            if (line.empty() == false)
+                break;
+            _head_size = 0;
         }
-        // 解析请求行
-        bool ret = ParseHttpLine(line);
-        if (ret == false) // 看起来写的很傻，其实是为了同一写法
+        if (ParseHttpLine(line) == false)
             return false;
-        // 在 解析请求报头的时候，不止一次 Parse
         // 首行处理完毕，进入头部获取阶段
         _recv_statu = RECV_HTTP_HEAD;
         return true;
     }
-    // 解析请求行
-    bool ParseHttpLine(const std::string &line)
+    // 解析请求行: 方法 SP 请求目标 SP 协议版本
+    bool ParseHttpLine(std::string_view line)
     {
-        std::smatch matches;
-        // std::regex::icase 代表忽略大小写
-        std::regex re("(GET|HEAD|POST|PUT|DELETE) ([^?\\s]+)(?:\\?(.*))? (HTTP/1\\.[01])(?:\n|\r\n)?", std::regex::icase);
-        bool ret = std::regex_match(line, matches, re);
-        if (ret == false)
+        size_t sp1 = line.find(' ');
+        if (sp1 == std::string_view::npos || sp1 == 0)
+            return SetError(400); // BAD REQUEST
+        size_t sp2 = line.find(' ', sp1 + 1);
+        if (sp2 == std::string_view::npos || sp2 == sp1 + 1)
+            return SetError(400);
+        std::string_view method = line.substr(0, sp1);
+        std::string_view target = line.substr(sp1 + 1, sp2 - sp1 - 1);
+        std::string_view version = line.substr(sp2 + 1);
+        // 请求方法: 不限定具体的方法，只要是合法的 token，由路由决定支不支持
+        for (char ch : method)
         {
-            _recv_statu = RECV_HTTP_ERROR;
-            _resp_statu = 400; // BAD REQUEST
-            return false;
+            if (IsToken(ch) == false)
+                return SetError(400);
         }
-        // 请求方法的获取
-        _request._method = matches[1];
+        // 协议版本: HTTP/主版本.次版本，只支持主版本 1，次版本大于 1 的按 HTTP/1.1 处理
+        if (version.size() != 8 || strncasecmp(version.data(), "HTTP/", 5) != 0 ||
+            isdigit((unsigned char)version[5]) == 0 || version[6] != '.' || isdigit((unsigned char)version[7]) == 0)
+            return SetError(400);
+        if (version[5] != '1')
+            return SetError(505); // HTTP VERSION NOT SUPPORTED
+        for (char ch : target)
+        {
+            if ((unsigned char)ch <= ' ' || ch == 0x7f)
+                return SetError(400);
+        }
+        _request._method.assign(method.data(), method.size());
         std::transform(_request._method.begin(), _request._method.end(), _request._method.begin(), ::toupper); // 把请求方法变大写
+        _request._version = version[7] == '0' ? "HTTP/1.0" : "HTTP/1.1";
         // 资源路径的获取，需要进行URL解码操作，但是不需要+转空格
-        _request._path = Util::UrlDecode(matches[2], false);
-        // 协议版本的获取
-        _request._version = matches[4];
-        // 查询字符串获取与处理
-        std::vector<std::string> query_string_arry;
-        std::string query_string = matches[3];
-        // 查询字符串的格式 key=val&key=val....., 先以 & 符号进行分割，得到各个字串
-        Util::Split(query_string, "&", &query_string_arry);
-        // 针对各个字串，以 = 符号进行分割，得到key 和val， 得到之后也需要进行URL解码
-        for (auto &str : query_string_arry)
-        {
-            size_t pos = str.find("=");
-            if (pos == std::string::npos)
-            {
-                _recv_statu = RECV_HTTP_ERROR;
-                _resp_statu = 400; // BAD REQUEST
-                return false;
-            }
-            std::string key = Util::UrlDecode(str.substr(0, pos), true);
-            std::string val = Util::UrlDecode(str.substr(pos + 1), true);
-            _request.SetParam(key, val);
+        size_t qpos = target.find('?');
+        _request._path = Util::UrlDecode(target.substr(0, qpos), false);
+        if (qpos == std::string_view::npos)
+            return true;
+        // 查询字符串的格式 key=val&key=val....., 以 & 分割得到各个字串，再以 = 分割得到 key 和 val，都需要进行URL解码
+        std::string_view query = target.substr(qpos + 1);
+        while (query.empty() == false)
+        {
+            size_t amp = query.find('&');
+            std::string_view str = query.substr(0, amp);
+            query = amp == std::string_view::npos ? std::string_view() : query.substr(amp + 1);
+            if (str.empty())
+                continue;
+            size_t pos = str.find('=');
+            if (pos == std::string_view::npos)
+                return SetError(400);
+            _request.SetParam(Util::UrlDecode(str.substr(0, pos), true), Util::UrlDecode(str.substr(pos + 1), true));
         }
         return true;
     }
     bool RecvHttpHead(Buffer *buf)
     {
-        if (_recv_statu != RECV_HTTP_HEAD)
-            return false;
-        // 请求报头是多行 key: val\r\n, 然后和正文以空行分割
-        while (1)
+        if (_recv_statu != RECV_HTTP_HEAD)
+            return false;
+        // 请求报头是多行 key: val\r\n, 然后和正文以空行分割
+        while (1)
+        {
+            std::string_view line;
+            int ret = NextLine(buf, &line);
+            if (ret < 0 || _head_size > MAX_HEADER_SIZE)
+                return SetError(431); // REQUEST HEADER FIELDS TOO LARGE
+            if (ret == 0)
+                return true;
+            // 读完了
+            if (line.empty())
+                break;
+            if (++_head_count > MAX_HEADER_COUNT)
+                return SetError(431);
+            if (ParseHttpHead(line, &_request._headers) == false)
+                return false;
+        }
+        // Content-Length 要在接收正文之前检查，避免后面转换时出错
+        std::string_view clen = _request.GetHeader(HDR_CONTENT_LENGTH);
+        if (clen.size() > 18 || clen.find_first_not_of("0123456789") != std::string_view::npos)
+            return SetError(400);
+        _content_length = _request.ContentLength();
+        // 只支持 chunked 一种传输编码; 和 Content-Length 同时出现时无法确定正文的边界(请求走私)，直接拒绝
+        if (_request.HasHeader(HDR_TRANSFER_ENCODING))
+        {
+            if (HttpHeaders::EqualsIgnoreCase(_request.GetHeader(HDR_TRANSFER_ENCODING), "chunked") == false)
+                return SetError(501); // NOT IMPLEMENTED
+            if (_request.HasHeader(HDR_CONTENT_LENGTH))
+                return SetError(400);
+            _chunked = true;
+        }
+        if (_body_config && _body_config->max_size > 0 && _content_length > _body_config->max_size)
+            return SetError(413); // PAYLOAD TOO LARGE
+        // 头部处理完毕，进入正文处理阶段
+        _recv_statu = RECV_HTTP_BODY;
+        return true;
+    }
+    // 解析一个头部字段: 字段名: 可选空白 值 可选空白
+    bool ParseHttpHead(std::string_view line, HttpHeaders *headers)
+    {
+        size_t pos = line.find(':');
+        if (pos == std::string_view::npos || pos == 0)
+            return SetError(400); // BAD REQUEST
+        std::string_view key = line.substr(0, pos);
+        for (char ch : key)
+        {
+            // 字段名和冒号之间不允许有空白，也不支持已经废弃的折行写法(以空白开头的行)
+            if (IsToken(ch) == false)
+                return SetError(400);
+        }
+        std::string_view val = line.substr(pos + 1);
+        size_t begin = val.find_first_not_of(" \t");
+        if (begin == std::string_view::npos)
+            val = std::string_view();
+        else
+            val = val.substr(begin, val.find_last_not_of(" \t") - begin + 1);
+        HttpHeader id = HttpHeaders::Lookup(key);
+        // 重复的 Content-Length(值不同) / Transfer-Encoding: 前后两个服务器可能各用一个，对正文边界的判断不一致(请求走私)
+        if (id == HDR_CONTENT_LENGTH && headers->Has(id))
+            return headers->Get(id) == val || SetError(400);
+        if (id == HDR_TRANSFER_ENCODING && headers->Has(id))
+            return SetError(400);
+        headers->Add(id, key, val);
+        return true;
+    }
+    // 流式接收函数出错时，用它在响应里设置的错误码
+    bool ReaderError()
+    {
+        _reader = nullptr;
+        return SetError(_response._statu >= 400 ? _response._statu : 500);
+    }
+    // 收到一段正文: 交给流式接收函数，或者放进内存，超过阈值之后写进临时文件
+    bool AppendBody(const char *data, size_t len)
+    {
+        _request._body_size += len;
+        if (_body_config && _body_config->max_size > 0 && _request._body_size > _body_config->max_size)
+            return SetError(413);
+        if (_reader)
+            return _reader(std::string_view(data, len)) || ReaderError();
+        if (!_request._body_file && _body_config && _body_config->spill_size > 0 && _request._body_size > _body_config->spill_size)
+        {
+            // 正文太大，改成写临时文件，已经收到的部分先写进去
+            auto file = std::make_shared<HttpBodyFile>();
+            if (file->Create(_body_config->spill_dir) == false || file->Write(_request._body.data(), _request._body.size()) == false)
+                return SetError(500);
+            std::string().swap(_request._body);
+            _request._body_file = file;
+        }
+        if (_request._body_file)
+            return _request._body_file->Write(data, len) || SetError(500);
+        _request._body.append(data, len);
+        return true;
+    }
+    // 正文接收完毕
+    bool EndBody()
+    {
+        if (_reader && _reader(std::string_view()) == false)
+            return ReaderError();
+        _recv_statu = RECV_HTTP_OVER;
+        return true;
+    }
+    // 按 Content-Length 接收正文
+    bool RecvLengthBody(Buffer *buf)
+    {
+        size_t len = std::min<uint64_t>(_content_length - _request._body_size, buf->ReadAbleSize());
+        if (len > 0)
+        {
+            if (AppendBody(buf->ReadAddr(), len) == false)
+                return false;
+            buf->MoveReaderOffset(len);
+        }
+        if (_request._body_size == _content_length)
+            return EndBody();
+        return true; // 数据不够，等待新数据(状态不改变)
+    }
+    // 接收分块传输的正文: 块大小(十六进制)[;扩展]\r\n 块数据\r\n ... 0\r\n [trailer 字段] \r\n
+    bool RecvChunkedBody(Buffer *buf)
+    {
+        while (1)
+        {
+            if (_chunk_statu == RECV_CHUNK_DATA)
+            {
+                size_t len = std::min<uint64_t>(_chunk_left, buf->ReadAbleSize());
+                if (len == 0)
+                    return true;
+                if (AppendBody(buf->ReadAddr(), len) == false)
+                    return false;
+                buf->MoveReaderOffset(len);
+                _chunk_left -= len;
+                if (_chunk_left > 0)
+                    return true;
+                _chunk_statu = RECV_CHUNK_DATA_END;
+                continue;
+            }
+            std::string_view line;
+            int ret = NextLine(buf, &line);
+            if (ret < 0)
+                return SetError(_chunk_statu == RECV_CHUNK_TRAILER ? 431 : 400);
+            if (ret == 0)
+                return true;
+            if (_chunk_statu == RECV_CHUNK_DATA_END)
+            {
+                if (line.empty() == false)
+                    return SetError(400);
+                _chunk_statu = RECV_CHUNK_SIZE;
+            }
+            else if (_chunk_statu == RECV_CHUNK_SIZE)
+            {
+                // 块大小行不计入头部大小，每一行都重新计算
+                _head_size = 0;
+                std::string_view hex = line.substr(0, line.find(';'));
+                while (hex.empty() == false && (hex.back() == ' ' || hex.back() == '\t'))
+                    hex.remove_suffix(1);
+                size_t size = 0;
+                auto res = std::from_chars(hex.data(), hex.data() + hex.size(), size, 16);
+                if (hex.empty() || hex.size() > 15 || res.ptr != hex.data() + hex.size())
+                    return SetError(400);
+                _chunk_left = size;
+                _chunk_statu = size > 0 ? RECV_CHUNK_DATA : RECV_CHUNK_TRAILER;
+            }
+            else
+            {
+                if (_head_size > MAX_HEADER_SIZE)
+                    return SetError(431);
+                if (line.empty())
+                    return EndBody();
+                if (++_head_count > MAX_HEADER_COUNT)
+                    return SetError(431);
+                if (ParseHttpHead(line, &_request._trailers) == false)
+                    return false;
+            }
+        }
+    }
+    bool RecvHttpBody(Buffer *buf)
+    {
+        if (_recv_statu != RECV_HTTP_BODY)
+            return false;
+        // 还没有确定正文怎么接收，先不动缓冲区里的正文
+        if (_body_begun == false)
+            return true;
+        return _chunked ? RecvChunkedBody(buf) : RecvLengthBody(buf);
+    }
+
+public:
+    HttpContext(const HttpBodyConfig *body_config = nullptr)
+        : _resp_statu(200), _recv_statu(RECV_HTTP_LINE), _pending(false), _scanned(0), _head_size(0), _head_count(0),
+          _body_config(body_config), _body_begun(false), _chunked(false), _chunk_statu(RECV_CHUNK_SIZE), _chunk_left(0), _content_length(0)
+    {
+    }
+    void ReSet()
+    {
+        _resp_statu = 200;
+        _recv_statu = RECV_HTTP_LINE;
+        _request.Reset();
+        _response.ReSet();
+        _pending = false;
+        _scanned = 0;
+        _head_size = 0;
+        _head_count = 0;
+        _reader = nullptr;
+        _body_begun = false;
+        _chunked = false;
+        _chunk_statu = RECV_CHUNK_SIZE;
+        _chunk_left = 0;
+        _content_length = 0;
+    }
+    int RespStatu() { return _resp_statu; }
+    bool SetError(int statu)
+    {
+        _recv_statu = RECV_HTTP_ERROR;
+        _resp_statu = statu;
+        return false;
+    }
+    // 请求是否带有正文
+    bool HasBody() { return _chunked || _content_length > 0; }
+    bool BodyBegun() { return _body_begun; }
+    // 头部收完之后确定正文怎么接收: reader 不为空时正文交给它，否则放在内存里(超过阈值落盘)
+    void BeginBody(const HttpBodyReader &reader)
+    {
+        _reader = reader;
+        _body_begun = true;
+    }
+    HttpRecvStatu RecvStatu() { return _recv_statu; }
+    HttpRequest &Request() { return _request; }
+    HttpResponse &Response() { return _response; }
+    bool Pending() { return _pending; }
+    void SetPending(bool pending) { _pending = pending; }
+    // 接收并解析Http请求，只有这个函数执行完，才能得到已经解析的 HttpRequest
+    void RecvHttpRequest(Buffer *buf)
+    {
+        // 处理完一个阶段立即进入下一个阶段，直到请求完整(OVER)、出错(ERROR)，或者数据不够(阶段没有变化)时退出等新数据
+        while (1)
+        {
+            HttpRecvStatu statu = _recv_statu;
+            switch (_recv_statu)
+            {
+            case RECV_HTTP_LINE:
+                RecvHttpLine(buf);
+                break;
+            case RECV_HTTP_HEAD:
+                RecvHttpHead(buf);
+                break;
+            case RECV_HTTP_BODY:
+                RecvHttpBody(buf);
+                break;
+            default:
+                return;
+            }
+            if (_recv_statu == statu)
+                return;
+        }
+    }
+};
+
+// 路由表(每个请求方法一个): 基数树(radix tree)，按请求路径逐字符向下匹配，查找的开销只和路径长度有关，和路由数量无关
+// 路由规则:
+//   /user/list        静态路径，完全相同才匹配
+//   /user/:id         :name 匹配一个路径段(到下一个 '/' 为止)，不能为空
+//   /static/*file     *name 匹配剩下的所有部分(可以包含 '/')，只能放在最后
+// 同一位置有多种规则时，优先级是 静态 > :name > *name
+// 基数树里找不到时，再按注册顺序尝试正则路由(AddRegex)
+class HttpRouter
+{
+private:
+    struct Node
+    {
+        std::string prefix;                         // 这个节点匹配的静态字符串
+        std::vector<std::unique_ptr<Node>> children; // 静态子节点，首字符各不相同
+        std::unique_ptr<Node> param;                // :name 子节点
+        std::unique_ptr<Node> wildcard;             // *name 子节点
+        std::string name;                           // :name / *name 节点的参数名
+        HttpHandler handler;
+        HttpBodyOpener opener;                      // 流式接收正文的路由才有
+    };
+    Node _root;
+    std::vector<std::pair<std::regex, HttpHandler>> _regex_routes;
+
+private:
+    // 把静态字符串插入到 node 下面，返回匹配完这个字符串之后所在的节点
+    static Node *InsertStatic(Node *node, std::string_view str)
+    {
+        while (str.empty() == false)
         {
-            std::string line = buf->GetLineAndPop();
-            // 没有找到换行
-            if (line.size() == 0)
+            Node *child = nullptr;
+            for (auto &c : node->children)
             {
-                // 但是 buf 的数据超过了一行最大数据，则认为出问题了
-                if (buf->ReadAbleSize() > MAX_LINE)
+                if (c->prefix[0] == str[0])
                 {
-                    _recv_statu = RECV_HTTP_ERROR; // 设置错误状态
-                    _resp_statu = 414;             // URI TOO LONG
-                    return false;
+                    child = c.get();
+                    break;
                 }
-                return true;
             }
-            // 虽然接受到了一行，但是这一行的数据也不符合要求
-            else if (line.size() > MAX_LINE)
+            if (child == nullptr)
             {
-                _recv_statu = RECV_HTTP_ERROR;
-                _resp_statu = 414;
-                return false;
+                node->children.push_back(std::make_unique<Node>());
+                node->children.back()->prefix.assign(str.data(), str.size());
+                return node->children.back().get();
             }
-            // 读完了
-            if (line == "\n" || line == "\r\n")
-                break;
-            bool ret = ParseHttpHead(line);
-            if (ret == false)
-                return false;
+            size_t len = 0;
+            while (len < child->prefix.size() && len < str.size() && child->prefix[len] == str[len])
+                len++;
+            if (len < child->prefix.size())
+            {
+                // 只有前一部分相同: 把子节点拆成 公共部分 + 剩余部分 两层
+                auto rest = std::make_unique<Node>();
+                rest->prefix = child->prefix.substr(len);
+                rest->children.swap(child->children);
+                rest->param.swap(child->param);
+                rest->wildcard.swap(child->wildcard);
+                rest->handler.swap(child->handler);
+                rest->opener.swap(child->opener);
+                child->prefix.resize(len);
+                child->children.push_back(std::move(rest));
+            }
+            node = child;
+            str.remove_prefix(len);
         }
-        // 头部处理完毕，进入正文处理阶段
-        _recv_statu = RECV_HTTP_BODY;
-        return true;
+        return node;
     }
-    bool ParseHttpHead(std::string &line)
+    static Node *Insert(Node *node, std::string_view pattern)
     {
-        if (line.back() == '\n')
-            line.pop_back(); // 末尾是换行则去掉换行字符
-        if (line.back() == '\r')
-            line.pop_back(); // 末尾是回车则去掉回车字符
-        size_t pos = line.find(": ");
-        if (pos == std::string::npos)
+        while (pattern.empty() == false)
         {
-            _recv_statu = RECV_HTTP_ERROR;
-            _resp_statu = 400; // BAD REQUEST
-            return false;
+            if (pattern[0] == ':' || pattern[0] == '*')
+            {
+                bool wildcard = pattern[0] == '*';
+                size_t end = wildcard ? pattern.size() : pattern.find('/');
+                std::string name(pattern.substr(1, end == std::string_view::npos ? std::string_view::npos : end - 1));
+                std::unique_ptr<Node> &child = wildcard ? node->wildcard : node->param;
+                if (!child)
+                {
+                    child = std::make_unique<Node>();
+                    child->name = name;
+                }
+                else if (child->name != name)
+                {
+                    ERR_LOG("ROUTE PARAM CONFLICT: %s / %s", child->name.c_str(), name.c_str());
+                    abort();
+                }
+                node = child.get();
+                pattern.remove_prefix(end == std::string_view::npos ? pattern.size() : end);
+                continue;
+            }
+            size_t end = pattern.find_first_of(":*");
+            node = InsertStatic(node, pattern.substr(0, end));
+            pattern.remove_prefix(end == std::string_view::npos ? pattern.size() : end);
         }
-        std::string key = line.substr(0, pos);
-        std::string val = line.substr(pos + 2); //  末尾的 \r\n也会被提取
-        _request.SetHeader(key, val);
-        return true;
+        return node;
     }
-    bool RecvHttpBody(Buffer *buf)
+    static const Node *Match(const Node *node, std::string_view path, HttpRequest &req)
     {
-        if (_recv_statu != RECV_HTTP_BODY)
-            return false;
-        // 1. 总共要接收的正文大小
-        ssize_t contentlength = _request.ContentLength();
-        // 2. 已经接收的正文大小, 即:  _request.body 的大小
-        // 得到真实需要接收的剩余大小
-        int real_size = contentlength - _request._body.size();
-        if (real_size == 0)
-        {
-            // 没有正文需要接收了, 请求解析完毕
-            _recv_statu = RECV_HTTP_OVER;
-            return true;
+        if (path.empty() && node->handler)
+            return node;
+        if (path.empty() == false)
+        {
+            for (auto &c : node->children)
+            {
+                if (c->prefix[0] != path[0])
+                    continue;
+                if (path.compare(0, c->prefix.size(), c->prefix) == 0)
+                {
+                    const Node *ret = Match(c.get(), path.substr(c->prefix.size()), req);
+                    if (ret)
+                        return ret;
+                }
+                break;
+            }
         }
-        // 3. 接收缓冲区中的正文拼接到 _request.body 中
-        // 3.1 数据够，则提取剩余正文
-        if (buf->ReadAbleSize() >= real_size)
+        if (node->param)
         {
-            _request._body.append(buf->ReadAddr(), real_size);
-            buf->MoveReaderOffset(real_size);
-            _recv_statu = RECV_HTTP_OVER;
-            return true;
+            std::string_view seg = path.substr(0, path.find('/'));
+            if (seg.empty() == false)
+            {
+                req._route_params.emplace_back(node->param->name, seg);
+                const Node *ret = Match(node->param.get(), path.substr(seg.size()), req);
+                if (ret)
+                    return ret;
+                req._route_params.pop_back();
+            }
         }
-        // 3.2 数据不够，则提取正文，并等待（即：状态不改变）
-        _request._body.append(buf->ReadAddr(), buf->ReadAbleSize());
-        buf->MoveReaderOffset(buf->ReadAbleSize());
-        return true;
+        if (node->wildcard && node->wildcard->handler)
+        {
+            req._route_params.emplace_back(node->wildcard->name, path);
+            return node->wildcard.get();
+        }
+        return nullptr;
     }
 
 public:
-    HttpContext() : _resp_statu(200), _recv_statu(RECV_HTTP_LINE) {}
-    void ReSet()
+    void Add(const std::string &pattern, const HttpHandler &handler, const HttpBodyOpener &opener = nullptr)
     {
-        _resp_statu = 200;
-        _recv_statu = RECV_HTTP_LINE;
-        _request.Reset();
+        Node *node = Insert(&_root, pattern);
+        node->handler = handler;
+        node->opener = opener;
     }
-    int RespStatu() { return _resp_statu; }
-    HttpRecvStatu RecvStatu() { return _recv_statu; }
-    HttpRequest &Request() { return _request; }
-    // 接收并解析Http请求，只有这个函数执行完，才能得到已经解析的 HttpRequest
-    void RecvHttpRequest(Buffer *buf)
+    void AddRegex(const std::string &pattern, const HttpHandler &handler)
+    {
+        _regex_routes.push_back(std::make_pair(std::regex(pattern), handler));
+    }
+    // 查找处理函数，找不到返回 nullptr; 路由参数保存到 req 中
+    const HttpHandler *Find(HttpRequest &req) const
     {
-        // 不同状态做不同的事，但是这里不 break, 因为处理完请求行后，应该立即往后处理，而不是退出等新数据
-        switch (_recv_statu)
+        req._route_params.clear();
+        // 参数指向 req._path，所以这里按引用匹配 req._path 本身
+        const Node *node = Match(&_root, req._path, req);
+        if (node)
+            return &node->handler;
+        req._route_params.clear();
+        for (auto &re_func : _regex_routes)
         {
-        case RECV_HTTP_LINE:
-            RecvHttpLine(buf);
-        case RECV_HTTP_HEAD:
-            RecvHttpHead(buf);
-        case RECV_HTTP_BODY:
-            RecvHttpBody(buf);
+            if (std::regex_match(req._path, req._matches, re_func.first))
+                return &re_func.second;
         }
-        return;
+        return nullptr;
+    }
+    // 请求头部收完时查找流式接收正文的函数，不是流式路由返回 nullptr; 路由参数保存到 req 中，opener 里可以使用
+    const HttpBodyOpener *FindOpener(HttpRequest &req) const
+    {
+        req._route_params.clear();
+        const Node *node = Match(&_root, req._path, req);
+        if (node && node->opener)
+            return &node->opener;
+        req._route_params.clear();
+        return nullptr;
     }
 };
 
 class HttpServer
 {
 private:
-    // 业务处理回调函数，并生成响应
-    using Handler = std::function<void(const HttpRequest &req, HttpResponse *resp)>;
-    // 路由表，存储: "URL 路径匹配规则" : "业务回调函数" 的映射
-    // 使用 "URL 路径匹配规则" 更灵活，比如 访问 usr/123 (后面为用户ID)，不管用户ID是什么，但是访问这个URL就是同一种业务
-    using Handlers = std::vector<std::pair<std::regex, Handler>>;
+    using Handler = HttpHandler;
+#ifdef HAS_COROUTINE
+    using AsyncHandler = HttpAsyncHandler;
+#endif
     // 不同请求方法对应的 路由表
-    Handlers _get_route;
-    Handlers _post_route;
-    Handlers _put_route;
-    Handlers _delete_route;
-    std::string _basedir; // 静态资源根目录
+    // 路由规则比如 /user/:id，访问 /user/123 (后面为用户ID)，不管用户ID是什么，但是访问这个URL就是同一种业务
+    std::unordered_map<std::string, HttpRouter> _routes;
+    std::string _basedir; // 静态资源根目录(末尾不带 /)
+    FileCache _file_cache; // 静态文件缓存，所有线程共享
+    size_t _open_cache_max; // 每个 loop 的打开文件缓存的大小
+    int _open_cache_valid;  // 打开文件缓存的有效时间(秒)
+    int _gzip_level;        // 动态响应的 gzip 压缩级别，0 表示不压缩(静态文件也不压缩)
+    size_t _gzip_min_length; // 正文小于这个大小不压缩
+    HttpBodyConfig _body_config; // 请求正文的接收设置(落盘阈值、大小上限)
+    int _max_pipeline;    // 一批最多处理的流水线请求数
     TcpServer _server;    // 底层依赖 Tcp
 
 private:
@@ -741,43 +2231,318 @@ private:
         // 2. 将错误页面，作为相应正文, 放入 resp
         resp->SetContent(body, "text/html");
     }
-    // 将 HttpResponse 对象按照 HTTP 协议格式组装成字节流，并发送
-    void WriteReponse(const PtrConnection &conn, HttpRequest &req, HttpResponse *resp)
+    static void Append(Buffer *out, std::string_view data) { out->WriteAndPush(data.data(), data.size()); }
+    static void AppendHeader(Buffer *out, std::string_view key, std::string_view val)
     {
-        // 1. 填写 resp 头部字段
-        // 1.1 长短连接: 只有当 resp 中没有显式设置 Connection 头时，才根据请求决定
-        if (!resp->HasHeader("Connection")) 
-        {
-            if (req.Close() == true)
-                resp->SetHeader("Connection", "close");
-            else
-                resp->SetHeader("Connection", "keep-alive");
-        }
-        // 1.2 正文长度
-        if (!resp->_body.empty() && !resp->HasHeader("Content-Length"))
-            resp->SetHeader("Content-Length", std::to_string(resp->_body.size()));
-        // 1.3 正文类型(如果真没有设置的话，默认为二进制(兼容))
-        if (!resp->_body.empty() && !resp->HasHeader("Content-Type"))
-            resp->SetHeader("Content-Type", "application/octet-stream");
-        // 1.4 重定向
+        Append(out, key);
+        Append(out, ": ");
+        Append(out, val);
+        Append(out, "\r\n");
+    }
+    // 将 HttpResponse 对象按照 HTTP 协议格式直接写进连接的发送链，返回是否是短连接
+    // 首行和头部写入发送缓冲区; 大的正文按引用挂在发送链上，发送时和头部一起聚集写，不再拷贝
+    // 流式正文在头部之后交给连接的数据生产者，边生产边发送，生产完之后再继续处理后面的流水线请求
+    // 同一轮循环里的多个(流水线)响应由连接在本轮结束时合并成一次发送
+    bool WriteReponse(const PtrConnection &conn, HttpRequest &req, HttpResponse *resp)
+    {
+        // 长短连接: 只有当 resp 中没有显式设置 Connection 头时，才根据请求决定
+        bool has_conn = resp->HasHeader(HDR_CONNECTION);
+        bool close = has_conn ? resp->Close() : req.Close();
+        // 重定向
         if (resp->_redirect_flag)
-            resp->SetHeader("Location", resp->_redirect_url); // 直接覆盖 更安全
+            resp->SetHeader(HDR_LOCATION, resp->_redirect_url); // 直接覆盖 更安全
+        bool send_body = req._method != "HEAD"; // HEAD 请求只要头部
+        // 长度未知的流式正文: HTTP/1.1 分块传输; HTTP/1.0 不支持分块，只能发完关闭连接来表示正文结束
+        bool chunked = resp->_stream && !resp->HasHeader(HDR_CONTENT_LENGTH);
+        if (chunked && req._version == "HTTP/1.0")
+        {
+            chunked = false;
+            close = true;
+            resp->SetHeader(HDR_CONNECTION, "close");
+            has_conn = true;
+        }
+        std::string_view body = resp->Body();
+        bool whole = send_body && resp->_ranges.empty(); // 发送整个正文
+        bool by_ref = whole && body.size() > HTTP_BODY_COPY_MAX;
 
-        // 2. 将 resp 中的要素按 HTTP 响应的格式组织成: 应答字节流
-        std::stringstream resp_str;
-        // 2.1 首行
-        resp_str << req._version << " " << std::to_string(resp->_statu) << " " << Util::StatuDesc(resp->_statu) << "\r\n";
-        // 2.2 应答报头
-        for (auto &head : resp->_headers)
+        Buffer *out = conn->OutputBuffer();
+        size_t before = out->ReadAbleSize();
+        // 1. 首行
+        Append(out, req._version);
+        Append(out, Util::StatusLine(resp->_statu));
+        // 2. 服务器填写的头部字段(使用者已经设置的不覆盖)
+        if (has_conn == false)
+            Append(out, close ? "Connection: close\r\n" : "Connection: keep-alive\r\n");
+        if (!resp->HasHeader(HDR_DATE))
+            AppendHeader(out, "Date", Util::HttpDate());
+        // 正文长度(流水线上的响应靠它来分界，没有正文也要写 0; 204 和 304 本来就没有正文，不写)
+        if (chunked)
+            Append(out, "Transfer-Encoding: chunked\r\n");
+        else if (!resp->HasHeader(HDR_CONTENT_LENGTH) && !resp->_stream && resp->_statu != 204 && resp->_statu != 304)
+        {
+            char num[32];
+            char *end = std::to_chars(num, num + sizeof(num), body.size()).ptr;
+            AppendHeader(out, "Content-Length", std::string_view(num, end - num));
+        }
+        // 正文类型(如果真没有设置的话，默认为二进制(兼容))
+        if ((!body.empty() || resp->_stream || resp->_file) && !resp->HasHeader(HDR_CONTENT_TYPE))
+            Append(out, "Content-Type: application/octet-stream\r\n");
+        // 3. 使用者设置的头部字段
+        for (auto head : resp->_headers)
+            AppendHeader(out, head.first, head.second);
+        // 4. 空行 + 正文
+        Append(out, "\r\n");
+        if (whole && by_ref == false)
+            Append(out, body);
+        conn->CommitOutput(out->ReadAbleSize() - before);
+        if (by_ref)
+        {
+            // 正文移交给发送链，发送完才释放; 响应对象马上会被重置，不能引用它本身
+            if (resp->_shared_holder)
+                conn->SendShared(resp->_shared_holder, body.data(), body.size());
+            else
+            {
+                auto holder = std::make_shared<std::string>(std::move(resp->_body));
+                conn->SendShared(holder, holder->data(), holder->size());
+            }
+        }
+        if (whole && resp->_file)
+            conn->SendFile(resp->_file, resp->_file->Fd(), resp->_file_offset, resp->_file_len);
+        if (send_body && resp->_ranges.empty() == false)
+            SendRanges(conn, resp);
+        if (send_body == false && resp->_writer)
+            resp->_writer->Discard(); // 写入对象不会被连接拉取，不能让它一直缓存到 End
+        if (send_body && resp->_stream)
+        {
+            // 生产者持有连接的弱引用: 连接释放时生产者跟着释放，不会互相持有
+            std::weak_ptr<Connection> weak = conn;
+            HttpBodyProducer stream = std::move(resp->_stream);
+            if (chunked)
+                stream = ChunkedProducer(std::move(stream), std::move(resp->_trailer));
+            if (resp->_writer)
+                resp->_writer->Attach(conn);
+            conn->SetWriteProducer([this, weak, stream](Buffer *buf)
+                                   {
+                if (stream(buf))
+                    return true;
+                // 正文发完了，下一轮循环再接着处理后面的请求(不能在生产者回调里面设置新的生产者)
+                PtrConnection conn = weak.lock();
+                if (conn)
+                    conn->GetLoop()->QueueInLoop(std::bind(&HttpServer::ResumePipeline, this, conn));
+                return false; });
+        }
+        return close;
+    }
+    // 流式压缩: 每次把 stream 生产的数据压缩后写进 buf，压缩状态跨多次调用保留
+    // 每次都同步刷新(Z_SYNC_FLUSH)，生产者暂时没有数据时已经生产的部分也能完整地发给对端
+    static HttpBodyProducer GzipProducer(HttpBodyProducer stream, int level)
+    {
+        std::shared_ptr<z_stream> zs(new z_stream(), [](z_stream *zs)
+                                     { deflateEnd(zs); delete zs; });
+        if (deflateInit2(zs.get(), level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        {
+            ERR_LOG("deflateInit2 FAILED");
+            abort();
+        }
+        auto input = std::make_shared<Buffer>();
+        return [stream, zs, input](Buffer *buf)
+        {
+            bool more = stream(input.get());
+            if (input->ReadAbleSize() == 0 && more)
+                return true;
+            zs->next_in = (Bytef *)input->ReadAddr();
+            zs->avail_in = input->ReadAbleSize();
+            int flush = more ? Z_SYNC_FLUSH : Z_FINISH;
+            int ret;
+            do
+            {
+                buf->EnsureWriteAble(16384);
+                zs->next_out = (Bytef *)buf->WirteAddr();
+                zs->avail_out = 16384;
+                ret = deflate(zs.get(), flush);
+                buf->MoveWriterOffset(16384 - zs->avail_out);
+            } while (zs->avail_out == 0 || (flush == Z_FINISH && ret == Z_OK));
+            input->Clear();
+            return more;
+        };
+    }
+    // 分块传输: 每次生产的数据前面加上长度行，后面加上 \r\n; 生产结束时写最后一块(长度 0)和 trailer
+    // 数据直接生产在发送缓冲区里: 先预留固定宽度(8 位十六进制)的长度行，生产完再填上，不用额外拷贝
+    // 把块长度写成 8 位十六进制数(不足 8 位前面补 0)，len 不能超过 0xffffffff
+    static void PutChunkSize(char *out, size_t len)
+    {
+        static const char digits[] = "0123456789abcdef";
+        for (int i = 7; i >= 0; i--, len >>= 4)
+            out[i] = digits[len & 0xf];
+    }
+    static HttpBodyProducer ChunkedProducer(HttpBodyProducer stream, HttpTrailerCallback trailer)
+    {
+        return [stream, trailer](Buffer *buf)
+        {
+            static const size_t HEAD_SIZE = 10;          // "xxxxxxxx\r\n"
+            static const size_t MAX_CHUNK = 0xffffffff; // 块长度头只留了 8 位十六进制数
+            size_t head = buf->ReadAbleSize();
+            Append(buf, "00000000\r\n");
+            bool more = stream(buf);
+            size_t len = buf->ReadAbleSize() - head - HEAD_SIZE;
+            if (len == 0)
+                buf->UnWrite(HEAD_SIZE); // 这次没有数据，不能发长度为 0 的块(那表示正文结束)
+            else
+            {
+                // 一次生产的数据超过一块的上限: 在上限处插入块的结尾和下一块的长度头，把数据分成几块
+                while (len > MAX_CHUNK)
+                {
+                    PutChunkSize(buf->ReadAddr() + head, MAX_CHUNK);
+                    size_t next = head + HEAD_SIZE + MAX_CHUNK;
+                    size_t rest = buf->ReadAbleSize() - next;
+                    buf->EnsureWriteAble(2 + HEAD_SIZE);
+                    memmove(buf->ReadAddr() + next + 2 + HEAD_SIZE, buf->ReadAddr() + next, rest);
+                    memcpy(buf->ReadAddr() + next, "\r\n00000000\r\n", 2 + HEAD_SIZE);
+                    buf->MoveWriterOffset(2 + HEAD_SIZE);
+                    head = next + 2;
+                    len -= MAX_CHUNK;
+                }
+                PutChunkSize(buf->ReadAddr() + head, len);
+                Append(buf, "\r\n");
+            }
+            if (more)
+                return true;
+            Append(buf, "0\r\n");
+            if (trailer)
+            {
+                HttpHeaders trailers;
+                trailer(&trailers);
+                for (auto it : trailers)
+                    AppendHeader(buf, it.first, it.second);
+            }
+            Append(buf, "\r\n");
+            return false;
+        };
+    }
+    // 发送正文 [offset, offset + len) 这一段: 文件正文用 sendfile，共享正文按引用发送，都不拷贝
+    void SendBodyRange(const PtrConnection &conn, HttpResponse *resp, size_t offset, size_t len)
+    {
+        if (resp->_file)
+            return conn->SendFile(resp->_file, resp->_file->Fd(), resp->_file_offset + offset, len);
+        std::string_view body = resp->Body().substr(offset, len);
+        if (resp->_shared_holder && body.size() > HTTP_BODY_COPY_MAX)
+            return conn->SendShared(resp->_shared_holder, body.data(), body.size());
+        conn->Send(body.data(), body.size());
+    }
+    // 发送范围请求的各段正文(多段时每段前面有自己的分隔行和头部)
+    void SendRanges(const PtrConnection &conn, HttpResponse *resp)
+    {
+        for (auto &range : resp->_ranges)
+        {
+            if (range.head.empty() == false)
+                conn->Send(range.head.data(), range.head.size());
+            SendBodyRange(conn, resp, range.offset, range.len);
+        }
+        if (resp->_ranges_tail.empty() == false)
+            conn->Send(resp->_ranges_tail.data(), resp->_ranges_tail.size());
+    }
+    // 压缩业务处理函数生成的正文: 文本类型、足够大、客户端接受 gzip 时才压缩
+    // 压缩输出一块一块地追加，不用预先分配整个正文大小的缓冲区
+    // 长度未知的流式正文边生产边压缩(见 GzipProducer)
+    void CompressResponse(const HttpRequest &req, HttpResponse *resp)
+    {
+        bool chunked = resp->_stream && !resp->HasHeader(HDR_CONTENT_LENGTH);
+        if (_gzip_level == 0 || resp->_shared_holder || resp->_file || (resp->_stream && !chunked))
+            return;
+        if (chunked == false && resp->_body.size() < _gzip_min_length)
+            return;
+        if (resp->_statu == 204 || resp->_statu == 304 || resp->_ranges.empty() == false || resp->HasHeader(HDR_CONTENT_ENCODING))
+            return;
+        if (Util::Compressible(resp->GetHeader(HDR_CONTENT_TYPE)) == false)
+            return;
+        if (resp->HasHeader(HDR_VARY) == false)
+            resp->SetHeader(HDR_VARY, "Accept-Encoding");
+        if (Util::AcceptGzip(req.GetHeader(HDR_ACCEPT_ENCODING)) == false)
+            return;
+        if (chunked)
+        {
+            resp->_stream = GzipProducer(std::move(resp->_stream), _gzip_level);
+            resp->SetHeader(HDR_CONTENT_ENCODING, "gzip");
+            return;
+        }
+        std::string compressed;
+        if (Util::Gzip(resp->_body, _gzip_level, &compressed) == false || compressed.size() >= resp->_body.size())
+            return;
+        resp->_body.swap(compressed);
+        resp->SetHeader(HDR_CONTENT_ENCODING, "gzip");
+        if (resp->HasHeader(HDR_CONTENT_LENGTH))
+            resp->SetHeader(HDR_CONTENT_LENGTH, std::to_string(resp->_body.size()));
+        // 压缩后的字节和原来的不一样了，使用者给的强 ETag 只能当弱 ETag 用
+        std::string_view etag = resp->GetHeader(HDR_ETAG);
+        if (etag.empty() == false && etag.compare(0, 2, "W/") != 0)
+            resp->SetHeader(HDR_ETAG, "W/" + std::string(etag));
+    }
+    // 一个响应写完之后的收尾: 重置上下文，返回是否可以继续处理后面的流水线请求
+    bool FinishRequest(const PtrConnection &conn, HttpContext *context, Buffer *buffer)
+    {
+        HttpRequest &req = context->Request();
+        HttpResponse &resp = context->Response();
+        CompressResponse(req, &resp);
+        bool streaming = resp._stream && req._method != "HEAD";
+        bool close = WriteReponse(conn, req, &resp);
+        context->ReSet();
+        if (close == true)
+        {
+            buffer->MoveReaderOffset(buffer->ReadAbleSize()); // 短连接后面的流水线请求不再处理
+            conn->Shutdown();                                 // 短链接则直接关闭
+            return false;
+        }
+        if (streaming)
+        {
+            // 流式正文还在发送，后面的请求等它发完(见 ResumePipeline)，期间不再读取对端数据
+            context->SetPending(true);
+            conn->PauseRead(HTTP_PAUSE_PENDING);
+            return false;
+        }
+        return true;
+    }
+    // 上一个响应处理完成(流式正文发完 / 协程结束)，继续处理暂停期间积压的请求
+    void ResumePipeline(const PtrConnection &conn)
+    {
+        if (conn->IsConnected() == false)
+            return;
+        HttpContext *context = std::any_cast<HttpContext>(conn->GetContext());
+        context->SetPending(false);
+        conn->ResumeRead(HTTP_PAUSE_PENDING); // 输入缓冲区里还有数据时，会再交给 OnMessage 处理(没有其他原因暂停读的话)
+    }
+    // 请求头部收完、正文还没有接收: 流式路由先调用 opener 得到正文接收函数，再告诉等待 100 Continue 的客户端继续发送正文
+    void BeginBody(const PtrConnection &conn, HttpContext *context, Buffer *buffer)
+    {
+        HttpRequest &req = context->Request();
+        HttpBodyReader reader;
+        auto it = _routes.find(req._method);
+        const HttpBodyOpener *opener = it == _routes.end() ? nullptr : it->second.FindOpener(req);
+        if (opener)
+        {
+            HttpResponse &resp = context->Response();
+            reader = (*opener)(req, &resp);
+            if (!reader)
+            {
+                context->SetError(resp._statu >= 400 ? resp._statu : 400);
+                return;
+            }
+        }
+        std::string_view expect = req.GetHeader(HDR_EXPECT);
+        if (expect.empty() == false)
         {
-            resp_str << head.first << ": " << head.second << "\r\n";
+            if (HttpHeaders::EqualsIgnoreCase(expect, "100-continue") == false)
+            {
+                context->SetError(417); // EXPECTATION FAILED
+                return;
+            }
+            // 客户端已经开始发送正文了就不用再回复
+            if (context->HasBody() && req._version == "HTTP/1.1" && buffer->ReadAbleSize() == 0)
+            {
+                static const char kContinue[] = "HTTP/1.1 100 Continue\r\n\r\n";
+                conn->Send(kContinue, sizeof(kContinue) - 1);
+            }
         }
-        // 2.3 空行
-        resp_str << "\r\n";
-        // 2.4 正文
-        resp_str << resp->_body;
-        // 3. 发送数据
-        conn->Send(resp_str.str().c_str(), resp_str.str().size());
+        context->BeginBody(reader);
     }
     // 是否是获取静态资源请求
     bool IsFileHandler(const HttpRequest &req)
@@ -791,62 +2556,317 @@ private:
         // 3. 请求的资源路径必须合理
         if (!Util::ValidPath(req._path))
             return false;
-        // 4. 请求的必须是普通文件
-        //    如果请求的是目录资源，则返回首页
-        std::string req_path = _basedir + req._path;
-        if (req_path.back() == '/')
-            req_path += "index.html";
-        if (Util::IsRegular(req_path) == false)
-            return false;
         return true;
     }
-    // 处理静态资源获取请求
-    // 将静态资源的文件内容读取出来 放到 resp._body 中，然后设置 mime 类型
-    void FileHandler(const HttpRequest &req, HttpResponse *resp)
+    // 请求对应的文件路径，和 inotify 报告的路径格式一致，作为文件缓存的键
+    //    如果请求的是目录资源，则返回首页
+    std::string FilePath(const HttpRequest &req)
     {
-        std::string req_path = _basedir + req._path;
+        std::string req_path = _basedir + Util::NormalizePath(req._path);
         if (req_path.back() == '/')
             req_path += "index.html";
-        bool ret = Util::ReadFile(req_path, &resp->_body);
-        if (ret == false)
-            return;
+        return req_path;
+    }
+    // 找到的静态文件: 小文件在文件缓存里(file)，大文件只有打开的描述符(handle)
+    // etag / last_modified 指向文件缓存或者当前 loop 的打开文件缓存，处理当前请求期间有效
+    struct StaticFile
+    {
+        PtrCachedFile file;
+        PtrFileHandle handle;
+        size_t size;
+        time_t mtime;
+        std::string_view etag;
+        std::string_view last_modified;
+    };
+    // 查找静态文件: 先找文件缓存，再通过当前 loop 的打开文件缓存打开(小文件顺便读进文件缓存)
+    // 不存在或者不是普通文件返回 false
+    bool FindFile(const std::string &path, StaticFile *sf)
+    {
+        sf->file = _file_cache.Get(path);
+        if (!sf->file)
+        {
+            OpenFileCache &open_cache = OpenFileCache::Local(_open_cache_max, _open_cache_valid);
+            const OpenFileInfo &info = open_cache.Open(path, _file_cache.Generation());
+            if (info.err != 0 || !info.file)
+                return false;
+            sf->file = _file_cache.Load(path, info.file->Fd(), info.st, info.generation);
+            if (!sf->file)
+            {
+                sf->handle = info.file;
+                sf->size = info.st.st_size;
+                sf->mtime = info.st.st_mtime;
+                sf->etag = info.etag;
+                sf->last_modified = info.last_modified;
+                return true;
+            }
+        }
+        sf->size = sf->file->content.size();
+        sf->mtime = sf->file->mtime;
+        sf->etag = sf->file->etag;
+        sf->last_modified = sf->file->last_modified;
+        return true;
+    }
+    // 处理静态资源获取请求，请求的不是普通文件时返回 false
+    // 小文件从文件缓存中取(所有线程共享一份，正文发送时不拷贝); 大文件不读进内存，由连接用 sendfile 发送
+    // 客户端接受 gzip 时: 有预先压缩好的 xxx.gz 就发送它，否则小文件用文件缓存里压缩过的版本(后台压缩好之前先发送原文件)
+    bool FileHandler(const HttpRequest &req, HttpResponse *resp)
+    {
+        std::string req_path = FilePath(req);
         std::string mime = Util::ExtMime(req_path);
-        resp->SetHeader("Content-Type", mime);
-        return;
+        bool compressible = _gzip_level > 0 && Util::Compressible(mime);
+        bool gzip = compressible && Util::AcceptGzip(req.GetHeader(HDR_ACCEPT_ENCODING));
+        StaticFile sf;
+        bool encoded = gzip && FindFile(req_path + ".gz", &sf);
+        if (encoded == false)
+        {
+            if (FindFile(req_path, &sf) == false)
+                return false;
+            PtrCachedFile compressed;
+            if (gzip && sf.file && sf.size >= _gzip_min_length)
+                compressed = _file_cache.Gzip(req_path, sf.file, FILE_CACHE_GZIP_LEVEL);
+            if (compressed)
+            {
+                encoded = true;
+                sf.file = compressed;
+                sf.size = compressed->content.size();
+                sf.etag = compressed->etag;
+            }
+        }
+        if (sf.file)
+        {
+            resp->SetSharedContent(sf.file, sf.file->content, mime);
+            resp->SetHeader(HDR_CONTENT_LENGTH, sf.file->length);
+        }
+        else
+            resp->SetFileContent(sf.handle, 0, sf.size, mime);
+        if (encoded)
+            resp->SetHeader(HDR_CONTENT_ENCODING, "gzip");
+        if (compressible)
+            resp->SetHeader(HDR_VARY, "Accept-Encoding"); // 同一个地址按 Accept-Encoding 返回不同的内容
+        size_t size = sf.size;
+        time_t mtime = sf.mtime;
+        std::string_view etag = sf.etag, last_modified = sf.last_modified;
+        resp->SetHeader(HDR_ETAG, etag);
+        resp->SetHeader(HDR_LAST_MODIFIED, last_modified);
+        resp->SetHeader(HDR_ACCEPT_RANGES, "bytes");
+        if (NotModified(req, etag, mtime))
+        {
+            // 客户端缓存的还是最新的: 304，只带验证器，不带正文
+            resp->_statu = 304;
+            resp->_shared_holder.reset();
+            resp->_shared_body = std::string_view();
+            resp->_file.reset();
+            resp->_headers.Erase("Content-Length");
+            resp->_headers.Erase("Content-Type");
+            resp->_headers.Erase("Content-Encoding");
+            return true;
+        }
+        if (req.HasHeader(HDR_RANGE) && IfRangeMatch(req, etag, mtime))
+            RangeHandler(req, resp, size);
+        return true;
     }
-    // 功能性请求的分发处理 (在指定的路由表里面，根据 [请求路径] 匹配对应的业务处理函数)
-    void Dispatcher(HttpRequest &req, HttpResponse *resp, Handlers handlers)
+    // 条件请求: If-None-Match 中有一个 ETag 和文件的弱比较相同(或者是 *)，
+    // 没有 If-None-Match 时 If-Modified-Since 之后文件没有修改过，返回 true(304)
+    static bool NotModified(const HttpRequest &req, std::string_view etag, time_t mtime)
+    {
+        if (req.HasHeader(HDR_IF_NONE_MATCH))
+        {
+            std::string_view list = req.GetHeader(HDR_IF_NONE_MATCH);
+            if (list == "*")
+                return true;
+            std::string_view opaque = WeakTag(etag);
+            while (list.empty() == false)
+            {
+                size_t comma = list.find(',');
+                std::string_view tag = list.substr(0, comma);
+                list = comma == std::string_view::npos ? std::string_view() : list.substr(comma + 1);
+                while (!tag.empty() && (tag.front() == ' ' || tag.front() == '\t'))
+                    tag.remove_prefix(1);
+                while (!tag.empty() && (tag.back() == ' ' || tag.back() == '\t'))
+                    tag.remove_suffix(1);
+                if (WeakTag(tag) == opaque)
+                    return true;
+            }
+            return false; // 有 If-None-Match 时忽略 If-Modified-Since
+        }
+        time_t since;
+        if (req.HasHeader(HDR_IF_MODIFIED_SINCE) && Util::ParseHttpDate(req.GetHeader(HDR_IF_MODIFIED_SINCE), &since))
+            return mtime <= since;
+        return false;
+    }
+    // 弱比较时去掉 W/ 前缀
+    static std::string_view WeakTag(std::string_view tag)
+    {
+        if (tag.compare(0, 2, "W/") == 0)
+            tag.remove_prefix(2);
+        return tag;
+    }
+    // If-Range: 没有这个头部，或者文件没有变过时，才按 Range 返回部分内容，否则返回整个文件
+    // 文件没有变过: ETag 强比较相同(弱 ETag 不算)，或者日期和修改时间完全相同
+    static bool IfRangeMatch(const HttpRequest &req, std::string_view etag, time_t mtime)
+    {
+        if (req.HasHeader(HDR_IF_RANGE) == false)
+            return true;
+        std::string_view cond = req.GetHeader(HDR_IF_RANGE);
+        if (cond.compare(0, 2, "W/") == 0 || cond.compare(0, 1, "\"") == 0)
+            return cond == etag && etag.compare(0, 2, "W/") != 0;
+        time_t date;
+        return Util::ParseHttpDate(cond, &date) && date == mtime;
+    }
+    // 解析 Range: bytes=0-99,200-,-500，把能满足的段放进 ranges(按请求的顺序)
+    // 格式不对或者段数太多返回 false(忽略 Range，返回整个文件)
+    static bool ParseRange(std::string_view value, size_t size, std::vector<std::pair<size_t, size_t>> *ranges)
+    {
+        if (value.compare(0, 6, "bytes=") != 0)
+            return false;
+        value.remove_prefix(6);
+        int count = 0;
+        while (value.empty() == false)
+        {
+            size_t comma = value.find(',');
+            std::string_view spec = value.substr(0, comma);
+            value = comma == std::string_view::npos ? std::string_view() : value.substr(comma + 1);
+            while (!spec.empty() && (spec.front() == ' ' || spec.front() == '\t'))
+                spec.remove_prefix(1);
+            while (!spec.empty() && (spec.back() == ' ' || spec.back() == '\t'))
+                spec.remove_suffix(1);
+            if (spec.empty())
+                continue; // 允许多余的逗号
+            if (++count > HTTP_MAX_RANGES)
+                return false;
+            size_t dash = spec.find('-');
+            if (dash == std::string_view::npos)
+                return false;
+            std::string_view first = spec.substr(0, dash), last = spec.substr(dash + 1);
+            uint64_t start = 0, end = 0;
+            if (first.empty())
+            {
+                // 后缀: -500 表示最后 500 字节
+                if (last.empty() || std::from_chars(last.data(), last.data() + last.size(), end).ptr != last.data() + last.size())
+                    return false;
+                if (end == 0 || size == 0)
+                    continue; // 不能满足
+                start = end >= size ? 0 : size - end;
+                ranges->emplace_back(start, size - start);
+                continue;
+            }
+            if (std::from_chars(first.data(), first.data() + first.size(), start).ptr != first.data() + first.size())
+                return false;
+            end = size - 1;
+            if (last.empty() == false)
+            {
+                if (std::from_chars(last.data(), last.data() + last.size(), end).ptr != last.data() + last.size() || end < start)
+                    return false;
+                if (end >= size)
+                    end = size - 1;
+            }
+            if (start >= size)
+                continue; // 不能满足
+            ranges->emplace_back(start, end - start + 1);
+        }
+        return count > 0;
+    }
+    // 合并重叠或相邻的段，避免 bytes=0-,0-,... 这样的请求把一个大文件重复发送很多遍(RFC 9110 §14.2)
+    // 请求的总长度超过了文件大小(重叠得很厉害)返回 false，忽略 Range 返回整个文件
+    // 有段被合并时按在文件中的顺序发送，否则保持请求的顺序
+    static bool CoalesceRanges(std::vector<std::pair<size_t, size_t>> *ranges, size_t size)
     {
-        // 在对应请求方法的路由表(regex : functor)中，查找是否含有对应资源请求的处理函数
-        //  思想: 接受到一个资源请求路径后，将请求路径和 路由表中的正则表达式匹配
-        //  如果匹配成功，则调对应的方法
-        for (auto &re_func : handlers)
+        if (ranges->size() < 2)
+            return true;
+        uint64_t requested = 0;
+        for (auto &range : *ranges)
+            requested += range.second;
+        if (requested > size)
+            return false;
+        std::vector<std::pair<size_t, size_t>> sorted(*ranges), merged;
+        std::sort(sorted.begin(), sorted.end());
+        for (auto &range : sorted)
         {
-            const std::regex &re = re_func.first;
-            const Handler &functor = re_func.second;
-            bool ret = std::regex_match(req._path, req._matches, re);
-            if (ret == false)
+            if (merged.empty() == false && range.first <= merged.back().first + merged.back().second)
+            {
+                size_t end = std::max(merged.back().first + merged.back().second, range.first + range.second);
+                merged.back().second = end - merged.back().first;
                 continue;
-            return functor(req, resp); // 传入请求信息，和空的resp，执行处理函数
+            }
+            merged.push_back(range);
+        }
+        if (merged.size() < ranges->size())
+            *ranges = std::move(merged);
+        return true;
+    }
+    // 范围请求: 一段返回 206 + Content-Range; 多段返回 206 + multipart/byteranges; 都不能满足返回 416
+    // 正文(共享正文或者文件)已经设置好了，这里只决定发送其中的哪几段
+    void RangeHandler(const HttpRequest &req, HttpResponse *resp, size_t size)
+    {
+        std::vector<std::pair<size_t, size_t>> ranges;
+        if (ParseRange(req.GetHeader(HDR_RANGE), size, &ranges) == false || CoalesceRanges(&ranges, size) == false)
+            return;
+        std::string total = std::to_string(size);
+        if (ranges.empty())
+        {
+            resp->_statu = 416; // Range Not Satisfiable
+            resp->_ranges.clear();
+            resp->_shared_holder.reset();
+            resp->_shared_body = std::string_view();
+            resp->_file.reset();
+            resp->SetHeader(HDR_CONTENT_RANGE, "bytes */" + total);
+            resp->SetHeader(HDR_CONTENT_LENGTH, "0");
+            return;
+        }
+        resp->_statu = 206;
+        if (ranges.size() == 1)
+        {
+            size_t start = ranges[0].first, len = ranges[0].second;
+            resp->_ranges.push_back({std::string(), start, len});
+            resp->SetHeader(HDR_CONTENT_RANGE, "bytes " + std::to_string(start) + "-" + std::to_string(start + len - 1) + "/" + total);
+            resp->SetHeader(HDR_CONTENT_LENGTH, std::to_string(len));
+            return;
+        }
+        // 多段: 每段前面是分隔行和这一段的头部，最后是结束分隔行，总长度提前算好
+        thread_local uint64_t boundary_seq = 0;
+        char boundary[32];
+        snprintf(boundary, sizeof(boundary), "%016lx%04lx", (unsigned long)time(nullptr), (unsigned long)(++boundary_seq & 0xffff));
+        std::string type(resp->GetHeader(HDR_CONTENT_TYPE));
+        size_t length = 0;
+        for (auto &range : ranges)
+        {
+            std::string head = "\r\n--";
+            head += boundary;
+            head += "\r\nContent-Type: " + type;
+            head += "\r\nContent-Range: bytes " + std::to_string(range.first) + "-" + std::to_string(range.first + range.second - 1) + "/" + total;
+            head += "\r\n\r\n";
+            length += head.size() + range.second;
+            resp->_ranges.push_back({std::move(head), range.first, range.second});
         }
+        resp->_ranges_tail = std::string("\r\n--") + boundary + "--\r\n";
+        length += resp->_ranges_tail.size();
+        resp->SetHeader(HDR_CONTENT_TYPE, std::string("multipart/byteranges; boundary=") + boundary);
+        resp->SetHeader(HDR_CONTENT_LENGTH, std::to_string(length));
+    }
+    // 功能性请求的分发处理 (在指定的路由表里面，根据 [请求路径] 匹配对应的业务处理函数)
+    void Dispatcher(HttpRequest &req, HttpResponse *resp, const HttpRouter &router)
+    {
+        const Handler *functor = router.Find(req);
+        if (functor)
+            return (*functor)(req, resp); // 传入请求信息，和空的resp，执行处理函数
         // 没找到，返回 404
         resp->_statu = 404;
     }
+    // 路由规则里有没有正则元字符: 基数树的规则只用 :name 和 *name，不会出现这些字符
+    static bool IsRegexPattern(const std::string &pattern)
+    {
+        return pattern.find_first_of("()[]{}\\^$+?|") != std::string::npos || pattern.find(".*") != std::string::npos;
+    }
     // 请求路由的总入口，决定请求由「静态资源处理器」还是「业务逻辑处理器」处理
     void Route(HttpRequest &req, HttpResponse *resp)
     {
         // 静态资源请求
-        if (IsFileHandler(req))
-            return FileHandler(req, resp);
-        // 动态资源请求
-        if (req._method == "GET" || req._method == "HEAD") // 两者一样，只是 HEAD 不要正文只要头部
-            return Dispatcher(req, resp, _get_route);
-        else if (req._method == "POST")
-            return Dispatcher(req, resp, _post_route);
-        else if (req._method == "PUT")
-            return Dispatcher(req, resp, _put_route);
-        else if (req._method == "DELETE")
-            return Dispatcher(req, resp, _delete_route);
+        if (IsFileHandler(req) && FileHandler(req, resp))
+            return;
+        // 动态资源请求: HEAD 和 GET 一样，只是 HEAD 不要正文只要头部
+        auto it = _routes.find(req._method == "HEAD" ? std::string("GET") : req._method);
+        if (it != _routes.end())
+            return Dispatcher(req, resp, it->second);
         // 没找到请求的处理方法
         resp->_statu = 405; // Method Not Allowed
         return;
@@ -855,27 +2875,46 @@ private:
     // Connection 存储的上下文是 HttpContext
     void OnConnected(const PtrConnection &conn)
     {
-        conn->SetContext(HttpContext());
+        conn->SetContext(HttpContext(&_body_config));
         DBG_LOG("NEW CONNECTION %p", conn.get());
     }
     // TCP 连接(Connection)收到数据时的回调函数，是 HTTP 处理的核心入口
+    // 一次读到的多个流水线请求依次处理，响应按顺序直接写进连接的发送链，本轮循环结束时一次发送
     void OnMessage(const PtrConnection &conn, Buffer *buffer)
     {
+        // 1. 获取上下文
+        HttpContext *context = std::any_cast<HttpContext>(conn->GetContext());
+        int count = 0;
         while (buffer->ReadAbleSize()) // 默认是长连接，如果还有数据就继续处理
         {
-            // 1. 获取上下文
-            std::any *tmp = conn->GetContext();
-            HttpContext *context = std::any_cast<HttpContext>(tmp);
+            // 上一个请求还在被协程异步处理，后面的请求先留在缓冲区里，保证响应按顺序发送
+            if (context->Pending())
+                break;
+            // 一批处理的请求数达到上限: 先把这一批响应发出去，剩下的请求下一轮循环再处理，避免一个连接长时间占住线程
+            if (count == _max_pipeline)
+            {
+                conn->PauseRead(HTTP_PAUSE_PIPELINE);
+                conn->GetLoop()->QueueInLoop(std::bind(&Connection::ResumeRead, conn, HTTP_PAUSE_PIPELINE));
+                break;
+            }
             // 2. 通过上下文对数据缓冲区的数据进行解析，得到 HttpRequest
             //    2.1 如果错误: 响应错误
             //    2.2 如果解析正常，即：得到 HttpRequest, 则去进行下一步(根据请求进行业务处理)处理
             context->RecvHttpRequest(buffer);
-            HttpRequest req = context->Request(); // 拿得到的 HttpRequest
-            HttpResponse resp(context->RespStatu());
+            // 头部刚收完: 先确定正文怎么接收，再接着接收正文
+            if (context->RecvStatu() == RECV_HTTP_BODY && context->BodyBegun() == false)
+            {
+                BeginBody(conn, context, buffer);
+                context->RecvHttpRequest(buffer);
+            }
+            HttpRequest &req = context->Request(); // 拿得到的 HttpRequest
+            HttpResponse &resp = context->Response();
+            resp._statu = context->RespStatu();
             if (context->RespStatu() >= 400) // 相应错误
             {
-                ErrorHandler(&resp);            // 展示一个错误页面
-                WriteReponse(conn, req, &resp); // 将错误响应写回
+                ErrorHandler(&resp);                             // 展示一个错误页面
+                resp.SetHeader(HDR_CONNECTION, "close"); // 出错之后的数据已经没法分界了，只能关闭连接
+                WriteReponse(conn, req, &resp);          // 错误响应排在这一批前面的响应后面
                 context->ReSet();
                 buffer->MoveReaderOffset(buffer->ReadAbleSize()); // 把缓冲区的错误内容清空
                 conn->Shutdown();                                 // 关闭连接
@@ -884,23 +2923,54 @@ private:
             if (context->RecvStatu() != RECV_HTTP_OVER)
             {
                 // 代表当前数据不完整, 则退出，后续有数据了，外部会再调用 OnMessage 函数
-                return;
+                break;
             }
             // 3. 请求路由 + 业务处理
             Route(req, &resp);
-            // 4. 对HttpResponse进行组织发送
-            WriteReponse(conn, req, &resp);
-            // 5. 重置上下文
-            context->ReSet();
-            // 6. 根据长短连接判断是否关闭连接或者继续处理
-            if (resp.Close() == true)
-                conn->Shutdown(); // 短链接则直接关闭
+            count++;
+#ifdef HAS_COROUTINE
+            // 命中的是协程处理函数: 交给协程，处理完成后由协程发送响应并继续处理后续请求
+            if (resp._async_handler)
+            {
+                context->SetPending(true);
+                conn->PauseRead(HTTP_PAUSE_PENDING); // 处理期间不再读取对端数据，完成后由 ResumePipeline 恢复
+                RunAsyncHandler(conn, context, buffer).Start();
+                return;
+            }
+#endif
+            // 4. 对HttpResponse进行组织发送，重置上下文，根据长短连接判断是否关闭连接或者继续处理
+            if (FinishRequest(conn, context, buffer) == false)
+                return;
         }
-        return;
     }
+#ifdef HAS_COROUTINE
+    // 协程路由的适配: 路由命中时只记录要执行的协程处理函数，由 OnMessage 启动
+    static void AsyncAdapter(const AsyncHandler &handler, const HttpRequest &, HttpResponse *resp)
+    {
+        resp->_async_handler = &handler;
+    }
+    // 执行协程处理函数，完成后发送响应，再接着处理缓冲区里剩下的请求
+    // conn 按值传入，保存在协程帧里，保证处理期间连接对象不会被释放
+    CoTask RunAsyncHandler(PtrConnection conn, HttpContext *context, Buffer *buffer)
+    {
+        HttpRequest &req = context->Request();
+        HttpResponse &resp = context->Response();
+        const AsyncHandler *handler = std::exchange(resp._async_handler, nullptr);
+        co_await (*handler)(req, &resp);
+        // 处理期间连接已经被释放(超时 / 对端关闭)，响应没有意义了
+        if (conn->IsConnected() == false)
+            co_return;
+        // 下一轮循环再接着处理: 协程没有挂起时这里还在 OnMessage 里面，直接处理会层层嵌套，也绕过了每批的请求数上限
+        if (FinishRequest(conn, context, buffer))
+            conn->GetLoop()->QueueInLoop(std::bind(&HttpServer::ResumePipeline, this, conn));
+    }
+#endif
 
 public:
-    HttpServer(int port, int timeout = DEFALT_TIMEOUT) : _server(port)
+    HttpServer(int port, int timeout = DEFALT_TIMEOUT) : _open_cache_max(OPEN_FILE_CACHE_MAX), _open_cache_valid(OPEN_FILE_CACHE_VALID),
+                                                         _gzip_level(HTTP_GZIP_LEVEL), _gzip_min_length(HTTP_GZIP_MIN_LENGTH),
+                                                         _body_config{HTTP_BODY_SPILL_SIZE, HTTP_BODY_SPILL_DIR, 0},
+                                                         _max_pipeline(HTTP_PIPELINE_DEPTH), _server(port)
     {
         _server.EnableInactiveRelease(timeout);
         // OnConnected的参数是外面设置的, 所以是预留一个位置
@@ -912,32 +2982,113 @@ public:
     void SetBaseDir(const std::string &path)
     {
         _basedir = path;
+        while (_basedir.size() > 1 && _basedir.back() == '/')
+            _basedir.pop_back();
+    }
+    // 设置静态文件缓存的总大小，以及能被缓存的单个文件的大小上限(更大的文件边读边发)
+    void SetFileCache(size_t capacity, size_t max_file)
+    {
+        _file_cache.SetCapacity(capacity, max_file);
+    }
+    // 设置 gzip 压缩: level 是动态响应的压缩级别(1~9，0 表示关闭压缩)，正文小于 min_length 不压缩
+    void SetGzip(int level, size_t min_length = HTTP_GZIP_MIN_LENGTH)
+    {
+        _gzip_level = level < 0 ? 0 : std::min(level, 9);
+        _gzip_min_length = min_length;
+    }
+    // 设置请求正文落盘: 正文超过 size 时写进 dir 目录下的临时文件(req._body_file)，size 为 0 表示都放在内存里(要在 Listen 之前设置)
+    void SetBodySpill(size_t size, const std::string &dir = HTTP_BODY_SPILL_DIR)
+    {
+        _body_config.spill_size = size;
+        _body_config.spill_dir = dir;
+    }
+    // 设置请求正文的大小上限，超过时返回 413，0 表示不限制(要在 Listen 之前设置)
+    void SetMaxBodySize(size_t size)
+    {
+        _body_config.max_size = size;
+    }
+    // 设置每个 loop 的打开文件缓存: 最多缓存多少个路径，结果多少秒内有效(要在 Listen 之前设置)
+    void SetOpenFileCache(size_t max, int valid_sec)
+    {
+        _open_cache_max = max > 0 ? max : 1;
+        _open_cache_valid = valid_sec;
     }
 
-    /*设置/添加，请求（请求的正则表达）与处理函数的映射关系*/
-    void Get(const std::string &pattern, const Handler &handler)
+    /*设置/添加，请求（路由规则，见 HttpRouter）与处理函数的映射关系*/
+    // 任意请求方法(比如 PATCH / OPTIONS)都可以注册
+    // 以前的路由都是正则，带正则元字符的(比如 "/numbers/(\\d+)")仍然按正则注册，不然注册成功却永远匹配不上
+    void Handle(const std::string &method, const std::string &pattern, const Handler &handler)
+    {
+        if (IsRegexPattern(pattern))
+            return HandleRegex(method, pattern, handler);
+        _routes[method].Add(pattern, handler);
+    }
+    void Get(const std::string &pattern, const Handler &handler) { Handle("GET", pattern, handler); }
+    void Post(const std::string &pattern, const Handler &handler) { Handle("POST", pattern, handler); }
+    void Put(const std::string &pattern, const Handler &handler) { Handle("PUT", pattern, handler); }
+    void Delete(const std::string &pattern, const Handler &handler) { Handle("DELETE", pattern, handler); }
+    // 正则路由: 基数树里找不到时按注册顺序逐个匹配，提取的数据在 req._matches 中
+    void HandleRegex(const std::string &method, const std::string &pattern, const Handler &handler)
+    {
+        _routes[method].AddRegex(pattern, handler);
+    }
+    void GetRegex(const std::string &pattern, const Handler &handler) { HandleRegex("GET", pattern, handler); }
+    void PostRegex(const std::string &pattern, const Handler &handler) { HandleRegex("POST", pattern, handler); }
+    void PutRegex(const std::string &pattern, const Handler &handler) { HandleRegex("PUT", pattern, handler); }
+    void DeleteRegex(const std::string &pattern, const Handler &handler) { HandleRegex("DELETE", pattern, handler); }
+    // 流式接收正文的路由: 正文一边收一边交给 opener 返回的接收函数，不在内存里保存，收完之后再调用 handler 生成响应
+    void HandleStream(const std::string &method, const std::string &pattern, const HttpBodyOpener &opener, const Handler &handler)
     {
-        _get_route.push_back(std::make_pair(std::regex(pattern), handler));
+        if (IsRegexPattern(pattern))
+        {
+            ERR_LOG("STREAM ROUTE CAN NOT BE A REGEX: %s", pattern.c_str());
+            abort();
+        }
+        _routes[method].Add(pattern, handler, opener);
+    }
+    void PostStream(const std::string &pattern, const HttpBodyOpener &opener, const Handler &handler) { HandleStream("POST", pattern, opener, handler); }
+    void PutStream(const std::string &pattern, const HttpBodyOpener &opener, const Handler &handler) { HandleStream("PUT", pattern, opener, handler); }
+#ifdef HAS_COROUTINE
+    // 协程版路由注册: 处理函数返回 CoTask, 可以在里面 co_await, 响应在协程结束后发送
+    void GetAsync(const std::string &pattern, const AsyncHandler &handler)
+    {
+        Get(pattern, std::bind(&HttpServer::AsyncAdapter, handler, std::placeholders::_1, std::placeholders::_2));
     }
-    void Post(const std::string &pattern, const Handler &handler)
+    void PostAsync(const std::string &pattern, const AsyncHandler &handler)
     {
-        _post_route.push_back(std::make_pair(std::regex(pattern), handler));
+        Post(pattern, std::bind(&HttpServer::AsyncAdapter, handler, std::placeholders::_1, std::placeholders::_2));
     }
-    void Put(const std::string &pattern, const Handler &handler)
+    void PutAsync(const std::string &pattern, const AsyncHandler &handler)
     {
-        _put_route.push_back(std::make_pair(std::regex(pattern), handler));
+        Put(pattern, std::bind(&HttpServer::AsyncAdapter, handler, std::placeholders::_1, std::placeholders::_2));
     }
-    void Delete(const std::string &pattern, const Handler &handler)
+    void DeleteAsync(const std::string &pattern, const AsyncHandler &handler)
     {
-        _delete_route.push_back(std::make_pair(std::regex(pattern), handler));
+        Delete(pattern, std::bind(&HttpServer::AsyncAdapter, handler, std::placeholders::_1, std::placeholders::_2));
     }
+#endif
     void SetThreadCount(int count)
     {
         _server.SetThreadCount(count);
     }
+    // 一个连接上一批最多连续处理多少个流水线请求，剩下的留到下一轮循环
+    void SetMaxPipeline(int depth)
+    {
+        _max_pipeline = depth > 0 ? depth : 1;
+    }
+#ifdef ENABLE_TLS
+    // 开启 HTTPS: 加载证书和私钥(PEM 格式)
+    bool EnableTls(const std::string &cert_file, const std::string &key_file)
+    {
+        return _server.EnableTls(cert_file, key_file);
+    }
+#endif
     // 启动服务器，开始监听端口并接受客户端连接
     void Listen()
     {
+        // 监控根目录下的文件变化，文件修改后缓存马上失效
+        if (_basedir.empty() == false)
+            _file_cache.Watch(_server.BaseLoop(), _basedir);
         _server.Start();
     }
 };
\ No newline at end of file
@@ -14,7 +14,7 @@ std::string RequestStr(const HttpRequest &req)
     {
         ss << it.first << ": " << it.second << "\r\n";
     }
-    for (auto &it : req._headers)
+    for (auto it : req._headers)
     {
         ss << it.first << ": " << it.second << "\r\n";
     }
@@ -33,11 +33,80 @@ void Login(const HttpRequest &req, HttpResponse *rsp)
     rsp->SetContent(RequestStr(req), "text/plain");
 }
 // 文件上传，把写的内容上传
+// 大的正文已经落盘在临时文件里(req._body_file)，直接移动过去，几个 G 的文件也不占内存
 void PutFile(const HttpRequest &req, HttpResponse *resp)
 {
     std::string pathname = WWWROOT + req._path;
-    Util::WriteFile(pathname, req._body);
+    if (req._body_file)
+    {
+        if (req._body_file->MoveTo(pathname) == false)
+            resp->_statu = 500;
+        return;
+    }
+    if (Util::WriteFile(pathname, req._body) == false)
+        resp->_statu = 500;
+}
+// 流式上传: PUT /upload/文件名，正文边收边直接写进目标文件，不经过内存和临时文件
+HttpBodyReader OpenUpload(const HttpRequest &req, HttpResponse *resp)
+{
+    std::string name(req.GetRouteParam("name"));
+    if (Util::ValidPath("/" + name) == false)
+        return nullptr;
+    std::string pathname = WWWROOT + name;
+    int fd = open(pathname.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        resp->_statu = 500;
+        return nullptr;
+    }
+    // 函数对象会被拷贝，文件描述符用 shared_ptr 管理，最后一份释放时关闭
+    auto file = std::shared_ptr<int>(new int(fd), [](int *fd) { close(*fd); delete fd; });
+    return [file, resp](std::string_view data)
+    {
+        if (data.empty())
+            return true;
+        if (write(*file, data.data(), data.size()) != (ssize_t)data.size())
+        {
+            resp->_statu = 500;
+            return false;
+        }
+        return true;
+    };
+}
+void Uploaded(const HttpRequest &req, HttpResponse *rsp)
+{
+    rsp->SetContent(std::to_string(req._body_size) + " bytes\n", "text/plain");
+}
+// 流式导出: 一行一行地生成，不用先在内存里拼出整个正文，套接字可写时才生成下一批
+void Report(const HttpRequest &, HttpResponse *rsp)
+{
+    auto row = std::make_shared<int>(0);
+    rsp->SetHeader(HDR_CONTENT_TYPE, "text/csv");
+    rsp->SetStream([row](Buffer *buf)
+                   {
+        for (int i = 0; i < 1000 && *row < 100000; i++, (*row)++)
+        {
+            std::string line = std::to_string(*row) + ",item-" + std::to_string(*row) + "\n";
+            buf->WriteAndPush(line.data(), line.size());
+        }
+        return *row < 100000; },
+                   [row](HttpHeaders *trailers)
+                   { trailers->Set("X-Rows", std::to_string(*row)); });
+}
+#ifdef HAS_COROUTINE
+// 协程处理函数可以 co_await 别的协程(子任务)，写法和同步代码一样; make main_co 用 C++20 编译时才有
+CoTask BuildPage(const HttpRequest &req, std::string *page)
+{
+    *page = "coroutine: " + req._path + "\n";
+    co_return;
+}
+CoTask AsyncHello(const HttpRequest &req, HttpResponse *rsp)
+{
+    std::string page;
+    co_await BuildPage(req, &page);
+    rsp->SetContent(page, "text/plain");
 }
+#endif
 // 也是回显
 void DelFile(const HttpRequest &req, HttpResponse *rsp)
 {
@@ -48,6 +117,11 @@ int main()
 {
     HttpServer server(8086);
     server.SetThreadCount(3);
+#ifdef ENABLE_TLS
+    // make main_tls 编译的是 HTTPS 服务器，证书和私钥放在当前目录下
+    if (server.EnableTls("./server.crt", "./server.key") == false)
+        return -1;
+#endif
     server.SetBaseDir(WWWROOT); // 设置静态资源根目录，告诉服务器有静态资源请求到来，需要到哪里去找资源文件
     // GET /hello 的时候就会回调 Hello 函数，不过 Hello 函数暂时设置成回显自己的请求文本
     // 在浏览器地址栏直接输入 URL 访问，默认发送的是 GET 请求
@@ -56,6 +130,11 @@ int main()
     server.Post("/login", Login);
     server.Put("/testput.txt", PutFile); // 会把内容写入 testput 文件里
     server.Delete("/DEL", DelFile);
+    server.Get("/report", Report); // 分块传输的流式响应
+    server.PutStream("/upload/:name", OpenUpload, Uploaded); // 流式接收的请求正文
+#ifdef HAS_COROUTINE
+    server.GetAsync("/co", AsyncHello); // 协程处理函数
+#endif
     server.Listen();
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,36 @@
+#include "rpc.hpp"
+
+/* RPC 服务测试 */
+// echo: 在 IO 线程里直接执行
+void Echo(std::string_view req, std::string *resp)
+{
+    resp->assign(req);
+}
+// 耗时的计算: 交给工作线程，不影响同一个连接上后面的请求
+void Slow(std::string_view req, std::string *resp)
+{
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    resp->assign("slow:");
+    resp->append(req);
+}
+
+int main()
+{
+    RpcServer server(9090);
+    server.SetThreadCount(3);
+    server.SetWorkerCount(2);
+    server.SetMaxInflight(64);
+    server.EnableInactiveRelease(10);
+    server.Inline("echo", Echo);
+    server.Worker("slow", Slow);
+    // 异步: 1 秒后完成(模拟等待上游的响应)，等待期间 IO 线程继续处理其他请求
+    server.Async("delay", [](std::string_view req, const RpcDone &done)
+                 {
+        std::string data(req);
+        std::thread([done, data]() {
+            std::this_thread::sleep_for(std::chrono::seconds(1));
+            done(RPC_OK, "delay:" + data);
+        }).detach(); });
+    server.Start();
+    return 0;
+}
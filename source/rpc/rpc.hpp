@@ -0,0 +1,333 @@
+#pragma once
+#include "../codec.hpp"
+
+// 流水线 RPC: 一个连接上可以连续发送多个请求，不用等前面的请求返回
+// 每个请求带一个请求 ID，服务端哪个请求先处理完就先回哪个，客户端按 ID 找到对应的回调
+//
+// 帧格式(4 字节大端长度头，见 codec.hpp):
+//   请求: [请求 ID 8 字节][方法名长度 2 字节][方法名][请求数据]
+//   响应: [请求 ID 8 字节][状态 1 字节][响应数据]
+using RpcCodec = LengthCodec<FixedLengthHeader<uint32_t>>;
+#define RPC_HEADER_SIZE 4
+#define RPC_REQUEST_HEAD 10  // 请求 ID + 方法名长度
+#define RPC_RESPONSE_HEAD 9  // 请求 ID + 状态
+#define RPC_MAX_FRAME (64 * 1024 * 1024)
+#define RPC_MAX_INFLIGHT 128 // 每个连接默认最多同时处理的请求数
+#define RPC_PAUSE_INFLIGHT READ_PAUSE_CUSTOM // 暂停读的原因: 进行中的请求达到上限
+
+typedef enum
+{
+    RPC_OK = 0,
+    RPC_NO_METHOD,   // 没有这个方法
+    RPC_BAD_REQUEST, // 请求格式错误
+    RPC_DISCONNECTED // 连接断开，请求没有得到响应(只在客户端出现)
+} RpcStatus;
+
+class RpcProto
+{
+public:
+    static void PutU64(char *out, uint64_t val)
+    {
+        for (int i = 0; i < 8; i++)
+            out[i] = (char)(val >> (8 * (7 - i)));
+    }
+    static uint64_t GetU64(const char *data)
+    {
+        uint64_t val = 0;
+        for (int i = 0; i < 8; i++)
+            val = (val << 8) | (uint8_t)data[i];
+        return val;
+    }
+    static void PutU16(char *out, uint16_t val)
+    {
+        out[0] = (char)(val >> 8);
+        out[1] = (char)val;
+    }
+    static uint16_t GetU16(const char *data) { return ((uint8_t)data[0] << 8) | (uint8_t)data[1]; }
+    // 发送响应，只能在连接所属的线程中调用: 几段数据直接追加到发送缓冲区，本轮循环结束时一起发出去
+    static void SendResponse(const PtrConnection &conn, uint64_t id, RpcStatus status, std::string_view payload)
+    {
+        char head[RPC_HEADER_SIZE + RPC_RESPONSE_HEAD];
+        FixedLengthHeader<uint32_t>::Encode(RPC_RESPONSE_HEAD + payload.size(), head);
+        PutU64(head + RPC_HEADER_SIZE, id);
+        head[RPC_HEADER_SIZE + 8] = (char)status;
+        conn->Send(head, sizeof(head));
+        if (payload.empty() == false)
+            conn->Send(payload.data(), payload.size());
+    }
+    static void SendRequest(const PtrConnection &conn, uint64_t id, std::string_view method, std::string_view payload)
+    {
+        char head[RPC_HEADER_SIZE + RPC_REQUEST_HEAD];
+        FixedLengthHeader<uint32_t>::Encode(RPC_REQUEST_HEAD + method.size() + payload.size(), head);
+        PutU64(head + RPC_HEADER_SIZE, id);
+        PutU16(head + RPC_HEADER_SIZE + 8, method.size());
+        conn->Send(head, sizeof(head));
+        conn->Send(method.data(), method.size());
+        if (payload.empty() == false)
+            conn->Send(payload.data(), payload.size());
+    }
+};
+
+// 处理完成的回调: 可以在任意线程、任意时间调用，但只能调用一次
+using RpcDone = std::function<void(RpcStatus, const std::string &)>;
+// 同步处理函数: 处理完直接把结果写进 response
+using RpcHandler = std::function<void(std::string_view request, std::string *response)>;
+// 异步处理函数: 在 IO 线程里被调用，不能阻塞，处理完(比如等到上游的响应)后调用 done
+// request 只在函数调用期间有效，之后还要用的话需要自己拷贝
+using RpcAsyncHandler = std::function<void(std::string_view request, const RpcDone &done)>;
+
+class RpcServer
+{
+private:
+    typedef enum
+    {
+        RPC_INLINE, // 在 IO 线程里直接执行(处理很快的方法)
+        RPC_WORKER, // 交给工作线程执行(耗时的、会阻塞的方法)
+        RPC_ASYNC   // 在 IO 线程里发起，自己决定什么时候完成
+    } RpcMode;
+    struct Method
+    {
+        RpcMode mode;
+        RpcHandler handler;
+        RpcAsyncHandler async_handler;
+    };
+    // 每个连接的状态，保存在连接的上下文里
+    struct Session
+    {
+        size_t inflight; // 已经开始处理还没有响应的请求数
+        bool blocked;    // 达到上限后暂停了读取，剩下的请求留在输入缓冲区里
+    };
+    using PtrSession = std::shared_ptr<Session>;
+
+    TcpServer _server;
+    RpcCodec _codec;
+    LoopThreadPool _workers; // 执行 RPC_WORKER 方法的线程池
+    int _worker_count;
+    size_t _max_inflight;
+    std::unordered_map<std::string, Method> _methods;
+
+private:
+    void OnConnected(const PtrConnection &conn)
+    {
+        conn->SetContext(std::make_shared<Session>(Session{0, false}));
+        DBG_LOG("NEW RPC CONNECTION %p", conn.get());
+    }
+    // 一直解析到缓冲区里没有完整的请求，或者达到同时处理的上限
+    void OnMessage(const PtrConnection &conn, Buffer *buf)
+    {
+        PtrSession session = std::any_cast<PtrSession>(*conn->GetContext());
+        std::string_view frame;
+        while (buf->ReadAbleSize() > 0)
+        {
+            if (session->inflight >= _max_inflight)
+            {
+                // 先不读了: 请求留在输入缓冲区里(不拷贝)，有请求完成后再继续
+                session->blocked = true;
+                conn->PauseRead(RPC_PAUSE_INFLIGHT);
+                return;
+            }
+            int ret = _codec.NextFrame(buf, &frame);
+            if (ret == 0)
+                return;
+            if (ret < 0)
+            {
+                buf->Clear();
+                return conn->Shutdown();
+            }
+            Dispatch(conn, session, frame);
+        }
+    }
+    void Dispatch(const PtrConnection &conn, const PtrSession &session, std::string_view frame)
+    {
+        if (frame.size() < RPC_REQUEST_HEAD)
+        {
+            ERR_LOG("BAD RPC REQUEST, SIZE %zu", frame.size());
+            return conn->Shutdown(); // 连请求 ID 都没有，没法回复
+        }
+        uint64_t id = RpcProto::GetU64(frame.data());
+        uint16_t method_len = RpcProto::GetU16(frame.data() + 8);
+        if (frame.size() < (size_t)RPC_REQUEST_HEAD + method_len)
+            return RpcProto::SendResponse(conn, id, RPC_BAD_REQUEST, "");
+        std::string_view method(frame.data() + RPC_REQUEST_HEAD, method_len);
+        std::string_view request = frame.substr(RPC_REQUEST_HEAD + method_len);
+        auto it = _methods.find(std::string(method));
+        if (it == _methods.end())
+            return RpcProto::SendResponse(conn, id, RPC_NO_METHOD, "");
+        Method &m = it->second;
+        session->inflight++;
+        if (m.mode == RPC_INLINE)
+        {
+            std::string response;
+            m.handler(request, &response);
+            return Complete(conn, session, id, RPC_OK, response);
+        }
+        if (m.mode == RPC_WORKER && _worker_count == 0)
+        {
+            // 没有工作线程，退化为在 IO 线程里直接执行
+            std::string response;
+            m.handler(request, &response);
+            return Complete(conn, session, id, RPC_OK, response);
+        }
+        EventLoop *loop = conn->GetLoop();
+        if (m.mode == RPC_ASYNC)
+        {
+            // done 可能在其他线程调用，统一回到连接所属的线程里完成
+            m.async_handler(request, [this, loop, conn, session, id](RpcStatus status, const std::string &response)
+                            { loop->RunInLoop(std::bind(&RpcServer::Complete, this, conn, session, id, status, response)); });
+            return;
+        }
+        // 工作线程里执行: 请求数据要拷贝一份，输入缓冲区里的数据很快会被覆盖
+        RpcHandler handler = m.handler;
+        std::string data(request);
+        _workers.NextLoop()->RunInLoop([this, loop, conn, session, id, handler, data]()
+                                       {
+            std::string response;
+            handler(data, &response);
+            loop->RunInLoop(std::bind(&RpcServer::Complete, this, conn, session, id, RPC_OK, std::move(response))); });
+    }
+    // 请求处理完成(在连接所属线程中): 按完成的顺序回复，不等前面的请求
+    void Complete(const PtrConnection &conn, const PtrSession &session, uint64_t id, RpcStatus status, const std::string &response)
+    {
+        session->inflight--;
+        if (conn->IsConnected() == false)
+            return;
+        RpcProto::SendResponse(conn, id, status, response);
+        if (session->blocked && session->inflight < _max_inflight)
+        {
+            // 恢复读取，积压在输入缓冲区里的请求会马上被处理
+            session->blocked = false;
+            conn->ResumeRead(RPC_PAUSE_INFLIGHT);
+        }
+    }
+    void Register(const std::string &name, RpcMode mode, const RpcHandler &handler, const RpcAsyncHandler &async_handler)
+    {
+        _methods[name] = Method{mode, handler, async_handler};
+    }
+
+public:
+    RpcServer(int port) : _server(port), _codec(RPC_MAX_FRAME), _workers(nullptr), _worker_count(0), _max_inflight(RPC_MAX_INFLIGHT)
+    {
+        _server.SetConnectedCallback(std::bind(&RpcServer::OnConnected, this, std::placeholders::_1));
+        _server.SetMessageCallback(std::bind(&RpcServer::OnMessage, this, std::placeholders::_1, std::placeholders::_2));
+    }
+    // IO 线程数
+    void SetThreadCount(int count) { _server.SetThreadCount(count); }
+    // 工作线程数: 没有工作线程时 Worker 方法也在 IO 线程里执行
+    void SetWorkerCount(int count)
+    {
+        _worker_count = count;
+        _workers.SetThreadCount(count);
+    }
+    // 每个连接最多同时处理的请求数，超过之后暂停读取这个连接
+    void SetMaxInflight(size_t count) { _max_inflight = count > 0 ? count : 1; }
+    void Inline(const std::string &name, const RpcHandler &handler) { Register(name, RPC_INLINE, handler, nullptr); }
+    void Worker(const std::string &name, const RpcHandler &handler) { Register(name, RPC_WORKER, handler, nullptr); }
+    void Async(const std::string &name, const RpcAsyncHandler &handler) { Register(name, RPC_ASYNC, nullptr, handler); }
+    void EnableInactiveRelease(int timeout) { _server.EnableInactiveRelease(timeout); }
+    void Start()
+    {
+        _workers.Create();
+        _server.Start();
+    }
+};
+
+// 异步 RPC 客户端: Call 立即返回，响应到达时调用回调
+// 同一个连接上的请求流水线发送，响应按服务端完成的顺序到达; 只能在所属 loop 线程中析构
+class RpcClient
+{
+public:
+    using ResponseCallback = std::function<void(RpcStatus, std::string_view)>;
+
+private:
+    EventLoop *_loop;
+    TcpClient _client;
+    RpcCodec _codec;
+    uint64_t _next_id;
+    std::unordered_map<uint64_t, ResponseCallback> _pending; // 已经发出还没收到响应的请求
+    Buffer _unsent; // 连接建立之前发起的请求先编码在这里，连上后一起发送
+
+private:
+    void OnConnected(const PtrConnection &conn)
+    {
+        if (_unsent.ReadAbleSize() > 0)
+            conn->Send(_unsent.ReadAddr(), _unsent.ReadAbleSize());
+        _unsent.Clear();
+    }
+    void OnFrame(const PtrConnection &conn, std::string_view frame)
+    {
+        if (frame.size() < RPC_RESPONSE_HEAD)
+        {
+            ERR_LOG("BAD RPC RESPONSE, SIZE %zu", frame.size());
+            return conn->Shutdown();
+        }
+        uint64_t id = RpcProto::GetU64(frame.data());
+        auto it = _pending.find(id);
+        if (it == _pending.end())
+            return;
+        ResponseCallback cb = std::move(it->second);
+        _pending.erase(it);
+        cb((RpcStatus)frame[8], frame.substr(RPC_RESPONSE_HEAD));
+    }
+    // 连接断开或者连不上: 还没收到响应的请求都以 RPC_DISCONNECTED 结束
+    void OnClosed(const PtrConnection &) { FailAll(); }
+    void OnConnectError(int err)
+    {
+        ERR_LOG("RPC CONNECT FAILED: %s", strerror(err));
+        _unsent.Clear();
+        FailAll();
+    }
+    void FailAll()
+    {
+        std::unordered_map<uint64_t, ResponseCallback> pending;
+        pending.swap(_pending);
+        for (auto &it : pending)
+            it.second(RPC_DISCONNECTED, "");
+    }
+    void CallInLoop(const std::string &method, const std::string &request, const ResponseCallback &cb)
+    {
+        // 方法名长度只有 2 个字节，整帧不能超过服务端的上限: 发出去服务端只会回错误的方法，或者直接断开连接
+        if (method.size() > UINT16_MAX || RPC_REQUEST_HEAD + method.size() + request.size() > RPC_MAX_FRAME)
+        {
+            ERR_LOG("RPC REQUEST TOO LARGE, METHOD %zu BYTES, REQUEST %zu BYTES", method.size(), request.size());
+            return cb(RPC_BAD_REQUEST, "");
+        }
+        uint64_t id = ++_next_id;
+        _pending[id] = cb;
+        PtrConnection conn = _client.GetConnection();
+        if (conn)
+            return RpcProto::SendRequest(conn, id, method, request);
+        char head[RPC_REQUEST_HEAD];
+        RpcProto::PutU64(head, id);
+        RpcProto::PutU16(head + 8, method.size());
+        char len[RPC_HEADER_SIZE];
+        FixedLengthHeader<uint32_t>::Encode(RPC_REQUEST_HEAD + method.size() + request.size(), len);
+        _unsent.WriteAndPush(len, sizeof(len));
+        _unsent.WriteAndPush(head, sizeof(head));
+        _unsent.WriteStringAndPush(method);
+        _unsent.WriteStringAndPush(request);
+    }
+
+public:
+    RpcClient(EventLoop *loop, const std::string &ip, uint16_t port)
+        : _loop(loop), _client(loop, ip, port), _codec(RPC_MAX_FRAME), _next_id(0)
+    {
+        _codec.SetFrameCallback(std::bind(&RpcClient::OnFrame, this, std::placeholders::_1, std::placeholders::_2));
+        _client.SetConnectedCallback(std::bind(&RpcClient::OnConnected, this, std::placeholders::_1));
+        _client.SetMessageCallback(std::bind(&RpcCodec::OnMessage, &_codec, std::placeholders::_1, std::placeholders::_2));
+        _client.SetClosedCallback(std::bind(&RpcClient::OnClosed, this, std::placeholders::_1));
+        _client.SetConnectErrorCallback(std::bind(&RpcClient::OnConnectError, this, std::placeholders::_1));
+    }
+    void SetConnectTimeout(uint32_t sec) { _client.SetConnectTimeout(sec); }
+    void SetMaxRetry(int count) { _client.SetMaxRetry(count); }
+    void EnableReconnect() { _client.EnableReconnect(); }
+    void Connect() { _client.Connect(); }
+    void Disconnect() { _client.Disconnect(); }
+    // 发起调用，可以在任意线程调用; cb 在 loop 线程中被调用，参数里的响应数据只在回调期间有效
+    // 方法名超过 65535 字节或者请求超过 RPC_MAX_FRAME 时不发送，cb 直接以 RPC_BAD_REQUEST 结束
+    void Call(const std::string &method, const std::string &request, const ResponseCallback &cb)
+    {
+        _loop->RunInLoop(std::bind(&RpcClient::CallInLoop, this, method, request, cb));
+    }
+    // 已经发出还没有响应的请求数，只能在 loop 线程中调用
+    size_t Pending() { return _pending.size(); }
+};
@@ -18,8 +18,25 @@
 #include <thread>
 #include <sys/eventfd.h>
 #include <sys/timerfd.h> // 包含 timerfd_create 所需的声明
+#include <sys/uio.h>     // struct iovec
+#include <sys/sendfile.h>
+#include <netinet/udp.h> // UDP_SEGMENT / UDP_GRO
+#include <signal.h>
 #include <any>
 #include <condition_variable>
+#include <atomic>
+#include <utility>
+#include <algorithm>
+
+// 协程支持: 只有在 C++20 且编译器支持协程时才启用 (http/makefile 的 main_co 用 -std=c++20 编译)
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+#include <coroutine>
+#define HAS_COROUTINE 1
+#endif
+#ifdef ENABLE_TLS // 编译时定义 ENABLE_TLS 开启 TLS 支持，需要链接 -lssl -lcrypto
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#endif
 
 // 这个文件只用来实现 Log 宏
 // 接受三个参数: 1. 日志等级; 2.要打印数据的类型; 3. 要打印的数据(不定参数)
@@ -29,7 +46,9 @@
 #define DBG 1
 #define ERR 2
 
+#ifndef LOGLEVEL
 #define LOGLEVEL DBG
+#endif
 
 // 日志宏
 // 宏定义的 '\'最好是行尾最后一个字符，和后面的换行符之间最后不要有空格
@@ -61,15 +80,16 @@ private:
     uint64_t _writer_idx;
 
 public:
-    Buffer() : _buffer(DEFAULT_BUFFER_CAPACITY), _reader_idx(0), _writer_idx(0) {}
+    // 第一次写入时才分配空间: 大量空闲连接的输入/输出缓冲区不用各占一块内存
+    Buffer() : _reader_idx(0), _writer_idx(0) {}
     // 缓冲区起始地址
-    char *BeginAddr() { return &_buffer[0]; }
+    char *BeginAddr() { return _buffer.data(); }
     // 写的真实地址
     char *WirteAddr() { return BeginAddr() + _writer_idx; }
     // 读的真实地址
     char *ReadAddr() { return BeginAddr() + _reader_idx; }
     // 缓冲区头部可写空间
-    uint64_t HeadWriteAbleSpace() { return _reader_idx - 1; }
+    uint64_t HeadWriteAbleSpace() { return _reader_idx; } // 读位置之前的空间都已经读走了，可以复用
     // 缓冲区尾部可写空间
     uint64_t TailWriteAbleSpace() { return _buffer.size() - _writer_idx; }
     // 可读数据大小
@@ -92,9 +112,12 @@ public:
         else
         {
             // 简单一点直接扩容 len （可能多扩，不是刚刚好）
-            DBG_LOG("RESIZE %ld", _writer_idx + len);
+            uint64_t size = _writer_idx + len;
+            if (size < DEFAULT_BUFFER_CAPACITY)
+                size = DEFAULT_BUFFER_CAPACITY;
+            DBG_LOG("RESIZE %ld", size);
 
-            _buffer.resize(_writer_idx + len);
+            _buffer.resize(size);
         }
     }
     // 写操作：都配备一个 1. 只写 2. 写完以后并移动指针
@@ -106,11 +129,17 @@ public:
         std::copy(d, d + len, WirteAddr());
     }
     // 移动写位置
-    void MoveWriterOffset(int len)
+    void MoveWriterOffset(uint64_t len)
     {
         assert(len <= TailWriteAbleSpace());
         _writer_idx += len;
     }
+    // 撤销最后写入的 len 字节(还没有被读走的数据)，比如预留的位置最后没有用上
+    void UnWrite(uint64_t len)
+    {
+        assert(len <= ReadAbleSize());
+        _writer_idx -= len;
+    }
     // 写完以后更新写位置
     void WriteAndPush(const void *data, uint64_t len)
     {
@@ -146,7 +175,7 @@ public:
         std::copy(ReadAddr(), ReadAddr() + len, (char *)buf);
     }
     // 移动读位置
-    void MoveReaderOffset(int len)
+    void MoveReaderOffset(uint64_t len)
     {
         assert(len <= ReadAbleSize());
         _reader_idx += len;
@@ -268,6 +297,35 @@ public:
         }
         return true;
     }
+    // 非阻塞连接(套接字需要先设置为非阻塞): 返回 0 表示已经连上，否则返回 errno
+    // EINPROGRESS 表示正在连接，等套接字可写后用 GetError 查看连接结果
+    int NonBlockConnect(uint16_t port, const std::string &ip)
+    {
+        struct sockaddr_in addr;
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        addr.sin_addr.s_addr = inet_addr(ip.c_str());
+        int ret = connect(_sockfd, (struct sockaddr *)&addr, sizeof(addr));
+        if (ret < 0)
+            return errno;
+        return 0;
+    }
+    // 获取套接字上待处理的错误(SO_ERROR)，0 表示没有错误
+    int GetError()
+    {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if (getsockopt(_sockfd, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+            return errno;
+        return err;
+    }
+    // 放弃描述符的所有权(析构时不再关闭)，返回描述符
+    int ReleaseFd()
+    {
+        int fd = _sockfd;
+        _sockfd = -1;
+        return fd;
+    }
     int Accept()
     {
         int fd = accept(_sockfd, nullptr, nullptr); // 不关心客户端信息
@@ -292,6 +350,8 @@ public:
                 return -1;
             }
         }
+        if (n == 0 && len > 0)
+            return -1; // 对端已经关闭连接, 当成出错处理, 让上层进入关闭流程
         return n;
     }
     // 设置套接字非阻塞
@@ -322,7 +382,52 @@ public:
     {
         if (len == 0)
             return 0;
-        return Send(buf, len, MSG_DONTWAIT); // MSG_DONTWAIT 表示当前发送为非阻塞。
+        // MSG_DONTWAIT 表示当前发送为非阻塞; MSG_NOSIGNAL 对端关闭时返回 EPIPE 而不是触发 SIGPIPE 杀掉进程
+        return Send(buf, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+    }
+    // 聚集写: 一次系统调用发送多块不连续的数据(相当于带 flags 的 writev)
+    // more 为 true 表示后面马上还有数据(比如紧跟着 sendfile 的文件)，内核先攒着不急着发出不满的包
+    ssize_t NonBlockSendv(const struct iovec *iov, int iovcnt, bool more = false)
+    {
+        if (iovcnt == 0)
+            return 0;
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = (struct iovec *)iov;
+        msg.msg_iovlen = iovcnt;
+        ssize_t n = sendmsg(_sockfd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL | (more ? MSG_MORE : 0));
+        if (n < 0)
+        {
+            if (errno == EAGAIN || errno == EINTR)
+                return 0;
+            ERR_LOG("sendmsg error");
+            return -1;
+        }
+        return n;
+    }
+    // 零拷贝发送文件的一段: 数据直接从页缓存到套接字，不经过用户态(套接字是非阻塞的)
+    ssize_t NonBlockSendFile(int fd, off_t offset, size_t len)
+    {
+        if (len == 0)
+            return 0;
+        // sendfile 没有 MSG_NOSIGNAL，对端关闭时会触发 SIGPIPE，第一次使用时忽略掉
+        static bool sigpipe_ignored = (signal(SIGPIPE, SIG_IGN), true);
+        (void)sigpipe_ignored;
+        ssize_t n = sendfile(_sockfd, fd, &offset, len);
+        if (n < 0)
+        {
+            if (errno == EAGAIN || errno == EINTR)
+                return 0;
+            ERR_LOG("sendfile error: %s", strerror(errno));
+            return -1;
+        }
+        if (n == 0)
+        {
+            // 还有数据要发却读到了文件末尾: 文件被截断，承诺的长度发不出来了(当作暂时写不下会一直触发可写事件)
+            ERR_LOG("sendfile reached EOF, %zu bytes left", len);
+            return -1;
+        }
+        return n;
     }
     ssize_t NonBlockRecv(void *buf, size_t len)
     {
@@ -358,17 +463,172 @@ public:
             return false;
         if (block_flag)
             NonBlock();
+        ReuseAddress(); // 地址重用要在 bind 之前设置才生效
         if (Bind(port, ip) == false)
             return false;
         if (Listen() == false)
             return false;
+        return true;
+    }
+    bool CreateUdp()
+    {
+        _sockfd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+        if (_sockfd < 0)
+        {
+            ERR_LOG("udp socket error");
+            return false;
+        }
+        return true;
+    }
+    // UDP 服务端套接字: 非阻塞，设置了 SO_REUSEPORT，多个套接字可以绑定同一个端口，由内核按来源分发数据报
+    bool CreateUdpServer(uint16_t port, const std::string &ip = "0.0.0.0")
+    {
+        if (CreateUdp() == false)
+            return false;
+        NonBlock();
         ReuseAddress();
+        if (Bind(port, ip) == false)
+            return false;
+        return true;
+    }
+};
+
+// 定长内存池: 一次向系统申请一大块内存(chunk)，切成大小相同的槽位，用空闲链表管理
+// 用来分配连接对象: 连接频繁创建销毁，不用每次都走 malloc，对象之间也不会共享 cache line
+// 连接在 baseloop 线程创建，可能在其他线程释放，所以需要加锁(每个 loop 一个池，竞争很小)
+#define SLAB_CHUNK_SLOTS 64
+#define CACHE_LINE_SIZE 64
+class SlabPool
+{
+private:
+    struct FreeNode
+    {
+        FreeNode *next;
+    };
+    size_t _slot_size;         // 槽位大小，第一次分配时确定(按 cache line 对齐)
+    FreeNode *_free;           // 空闲槽位链表
+    std::vector<void *> _chunks; // 申请过的大块内存
+    std::mutex _mutex;
+
+private:
+    void Grow()
+    {
+        char *chunk = (char *)::operator new(_slot_size * SLAB_CHUNK_SLOTS, std::align_val_t(CACHE_LINE_SIZE));
+        _chunks.push_back(chunk);
+        for (int i = SLAB_CHUNK_SLOTS - 1; i >= 0; i--)
+        {
+            FreeNode *node = (FreeNode *)(chunk + i * _slot_size);
+            node->next = _free;
+            _free = node;
+        }
+    }
+
+public:
+    SlabPool() : _slot_size(0), _free(nullptr) {}
+    ~SlabPool()
+    {
+        for (auto chunk : _chunks)
+            ::operator delete(chunk, std::align_val_t(CACHE_LINE_SIZE));
+    }
+    void *Alloc(size_t size)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        if (_slot_size == 0)
+            _slot_size = (size + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE * CACHE_LINE_SIZE;
+        if (size > _slot_size) // 不是这个池负责的大小，交给系统
+            return ::operator new(size);
+        if (_free == nullptr)
+            Grow();
+        FreeNode *node = _free;
+        _free = node->next;
+        return node;
+    }
+    void Free(void *ptr, size_t size)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        if (size > _slot_size)
+            return ::operator delete(ptr);
+        FreeNode *node = (FreeNode *)ptr;
+        node->next = _free;
+        _free = node;
+    }
+};
+// 给 std::allocate_shared 用的分配器: 对象和 shared_ptr 的控制块放在同一个槽位里，一次分配
+template <class T>
+class SlabAllocator
+{
+public:
+    using value_type = T;
+    SlabPool *_pool;
+
+public:
+    explicit SlabAllocator(SlabPool *pool) : _pool(pool) {}
+    template <class U>
+    SlabAllocator(const SlabAllocator<U> &other) : _pool(other._pool) {}
+    T *allocate(size_t n) { return (T *)_pool->Alloc(n * sizeof(T)); }
+    void deallocate(T *ptr, size_t n) { _pool->Free(ptr, n * sizeof(T)); }
+    template <class U>
+    bool operator==(const SlabAllocator<U> &other) const { return _pool == other._pool; }
+    template <class U>
+    bool operator!=(const SlabAllocator<U> &other) const { return _pool != other._pool; }
+};
+
+#ifdef ENABLE_TLS
+// TLS 服务端配置: 证书、私钥、会话缓存，同一个服务器的所有连接共享一个(SSL_CTX 是线程安全的)
+// 握手完成后如果内核支持 kTLS(需要加载 tls 模块)，OpenSSL 会把会话密钥交给内核，
+// 之后 SSL_read/SSL_write 就是普通的 read/write，加解密在内核里完成，文件也可以直接 sendfile
+#define TLS_SESSION_CACHE_SIZE 20480
+class TlsContext
+{
+private:
+    SSL_CTX *_ctx;
+
+public:
+    TlsContext() : _ctx(nullptr) {}
+    ~TlsContext()
+    {
+        if (_ctx)
+            SSL_CTX_free(_ctx);
+    }
+    bool Init(const std::string &cert_file, const std::string &key_file)
+    {
+        // OpenSSL 用 write 发送数据，对端关闭时会触发 SIGPIPE
+        signal(SIGPIPE, SIG_IGN);
+        _ctx = SSL_CTX_new(TLS_server_method());
+        if (_ctx == nullptr)
+        {
+            ERR_LOG("SSL_CTX_new FAILED!");
+            return false;
+        }
+        SSL_CTX_set_min_proto_version(_ctx, TLS1_2_VERSION);
+        // 非阻塞发送: 允许只写出一部分; 重试时缓冲区地址可能变了(Buffer 会移动数据)
+        SSL_CTX_set_mode(_ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+#ifdef SSL_OP_ENABLE_KTLS
+        SSL_CTX_set_options(_ctx, SSL_OP_ENABLE_KTLS);
+#endif
+        // 会话复用: 服务端会话缓存(会话 ID) + 会话票据(默认开启)，客户端重连时省掉完整握手
+        static const unsigned char sid_ctx[] = "server";
+        SSL_CTX_set_session_cache_mode(_ctx, SSL_SESS_CACHE_SERVER);
+        SSL_CTX_sess_set_cache_size(_ctx, TLS_SESSION_CACHE_SIZE);
+        SSL_CTX_set_session_id_context(_ctx, sid_ctx, sizeof(sid_ctx) - 1);
+        if (SSL_CTX_use_certificate_chain_file(_ctx, cert_file.c_str()) != 1 ||
+            SSL_CTX_use_PrivateKey_file(_ctx, key_file.c_str(), SSL_FILETYPE_PEM) != 1 ||
+            SSL_CTX_check_private_key(_ctx) != 1)
+        {
+            ERR_LOG("LOAD CERTIFICATE %s KEY %s FAILED!", cert_file.c_str(), key_file.c_str());
+            return false;
+        }
         return true;
     }
+    SSL *NewSession() { return SSL_new(_ctx); }
 };
+#endif
 
 class Epoller; // 先声明
 class EventLoop;
+class UpstreamPool;
+class Connection;
+using PtrConnection = std::shared_ptr<Connection>;
 // 对于一个描述符进行 "监控事件" 管理的模块
 // 为了: 用户更容易维护 描述符的监控事件， 事件触发后的处理流程更加清晰
 class Channel
@@ -378,6 +638,8 @@ private:
     EventLoop *_loop;  // Channel 所属的lopp绑定
     uint32_t _events;  // 要监控的事件
     uint32_t _revents; // 实际触发的监控事件
+    uint32_t _committed_events; // 最近一次同步到 epoll 的事件
+    bool _registered;           // 是否已经添加到 epoll 中
     using EventCallback = std::function<void()>;
     EventCallback _read_callback;  // 可读事件触发回调函数
     EventCallback _write_callback; // 可写事件触发回调函数
@@ -386,7 +648,7 @@ private:
     EventCallback _event_callback; // 任意事件触发回调函数(在特定时间回调后调用，可以用来设置一些同一操作，如: 日志...)
 
 public:
-    Channel(EventLoop *loop, int fd) : _fd(fd), _events(0), _revents(0), _loop(loop) {}
+    Channel(EventLoop *loop, int fd) : _fd(fd), _loop(loop), _events(0), _revents(0), _committed_events(0), _registered(false) {}
     int Fd() { return _fd; }
     // 获取想要监控的事件
     uint32_t Events()
@@ -432,7 +694,7 @@ public:
         return _events & EPOLLOUT;
     }
     // 先做函数声明，实现要在后面
-    // 将事件监控配置 同步到底层 epoll实例
+    // 将事件监控配置 同步到底层 epoll实例(监控事件没有变化时不调用 epoll_ctl)
     void Update();
     // 移除监控
     void Remove();
@@ -451,10 +713,10 @@ public:
         _events |= EPOLLOUT;
         Update();
     }
-    // 关闭读事件监控
+    // 关闭读事件监控(和 EnableRead 对称，否则对端半关闭后 EPOLLRDHUP 会一直触发)
     void DisableRead()
     {
-        _events &= ~EPOLLIN;
+        _events &= ~(EPOLLIN | EPOLLPRI | EPOLLRDHUP);
         Update();
     }
     // 关闭可写事件监控
@@ -472,7 +734,7 @@ public:
     // 一旦连接触发了事件，外面的就调用这个函数，具体触发了什么事件由 Channel 判断，简化外界处理流程
     void HandleEvent()
     {
-        if ((_revents | EPOLLIN) | (_revents | EPOLLPRI) | (_revents | EPOLLRDHUP))
+        if (_revents & (EPOLLIN | EPOLLPRI | EPOLLRDHUP))
         {
             if (_read_callback)
                 _read_callback();
@@ -628,6 +890,10 @@ public:
     {
         _cancel = true;
     }
+    void Restore() // 取消之后又重新启用
+    {
+        _cancel = false;
+    }
     uint32_t GetDelay()
     {
         return _outtime;
@@ -656,7 +922,13 @@ class TimeWheel
 private:
     int _capacity;                                     // 时间轮的时间大小
     int _tick;                                         // 时间指针
-    std::vector<std::vector<TaskPtr>> _wheel;          // 二维数组, 同一个时刻上可能存在多个要执行的定时任务
+    // 轮子上的一项: 超过一圈的定时任务放在 (tick + delay) % capacity 的位置，指针每经过一次减一圈，减到 0 才释放
+    struct WheelEntry
+    {
+        TaskPtr task;
+        uint32_t rounds; // 还要再转几圈
+    };
+    std::vector<std::vector<WheelEntry>> _wheel;       // 二维数组, 同一个时刻上可能存在多个要执行的定时任务
     std::unordered_map<uint64_t, TaskWeakPtr> _timers; // 存放定时任务信息
 
     EventLoop *_loop;
@@ -690,11 +962,29 @@ private:
         timerfd_settime(timerfd, 0, &tmr, nullptr);
         return timerfd;
     }
+    // 把定时任务放到 delay 秒后的位置，delay 超过一圈时记下还要转的圈数(delay 为 0 按 1 秒算)
+    void Insert(const TaskPtr &pt, uint32_t delay)
+    {
+        if (delay == 0)
+            delay = 1;
+        int pos = (_tick + delay) % _capacity;
+        _wheel[pos].push_back({pt, (delay - 1) / _capacity});
+    }
     // 这个函数应该每秒钟被执行一次，相当于秒针向后走了一步
     void RunTimerTask()
     {
         _tick = (_tick + 1) % _capacity;
-        _wheel[_tick].clear(); // 清空指定位置的数组，就会把数组中保存的所有管理定时器对象的shared_ptr释放掉
+        // 清空指定位置的数组，就会把数组中保存的所有管理定时器对象的shared_ptr释放掉
+        // 先换到局部变量里再释放: 定时任务里可能又会添加新的定时任务(比如协程再次 sleep), 不能边清空边插入同一个数组
+        std::vector<WheelEntry> expired;
+        expired.swap(_wheel[_tick]);
+        for (auto &entry : expired)
+        {
+            if (entry.rounds == 0)
+                continue;
+            entry.rounds--; // 还没到期，留在原位置等下一圈
+            _wheel[_tick].push_back(std::move(entry));
+        }
     }
     int ReadTimefd()
     {
@@ -723,8 +1013,7 @@ private:
     {
         TaskPtr pt(new TimeTask(id, delay, cb));
         pt->SetRelease(std::bind(&TimeWheel::RemoveTimer, this, id));
-        int pos = (_tick + delay) % _capacity;
-        _wheel[pos].push_back(pt);
+        Insert(pt, delay);
         _timers[id] = TaskWeakPtr(pt);
     }
     void TimerRefreshInLoop(uint64_t id)
@@ -736,9 +1025,8 @@ private:
             return; // 没找着定时任务，没法刷新，没法延迟
         }
         TaskPtr pt = it->second.lock(); // lock获取weak_ptr管理的对象对应的shared_ptr
-        int delay = pt->GetDelay();
-        int pos = (_tick + delay) % _capacity;
-        _wheel[pos].push_back(pt);
+        pt->Restore();                  // 被取消后还没到期的定时任务，刷新时重新启用(比如连接先取消又重新启动了非活跃释放)
+        Insert(pt, pt->GetDelay());
     }
     void TimerCancelInLoop(uint64_t id)
     {
@@ -765,8 +1053,7 @@ public:
     {
         TaskPtr pt(new TimeTask(id, delay, cb));
         pt->SetRelease(std::bind(&TimeWheel::RemoveTimer, this, id)); // this 是 RemoverTimer 的第一个隐藏参数
-        int pos = (_tick + delay) % _capacity;                        // 设置定时任务执行位置
-        _wheel[pos].emplace_back(pt);
+        Insert(pt, delay);                                            // 设置定时任务执行位置
         _timers[id] = TaskWeakPtr(pt); // 用 share_ptr 构造一个 weak_ptr
     }
 
@@ -777,9 +1064,7 @@ public:
         if (it == _timers.end())
             return;
         TaskPtr pt = _timers[id].lock(); // weak_ptr 调用 lock() 得到 shared_ptr
-        int delay = pt->GetDelay();
-        int pos = (_tick + delay) % _capacity;
-        _wheel[pos].emplace_back(pt);
+        Insert(pt, pt->GetDelay());
     }
     void CancelTimer(uint64_t id)
     {
@@ -820,6 +1105,16 @@ private:
     std::vector<Functor> _tasks; // 任务队列
     std::mutex _mutex;           // 实现任务池操作的线程安全
     TimeWheel _timer_wheel;      // 定时器模块
+    // 内部定时任务(RunAfter / 协程 sleep)的 ID，最高位置 1，避免和连接 ID 冲突
+    std::atomic<uint64_t> _timer_seq;
+    SlabPool _conn_slab; // 属于这个 loop 的连接对象从这里分配
+    // 持有连接的成员都要在 _conn_slab 之后声明: 析构时先释放连接，再释放内存池
+    // 本轮循环里有数据待发送的连接，在一轮循环的最后统一发送一次(写合并)
+    std::vector<PtrConnection> _pending_flush;
+    // 分配到这个 loop 的连接由这个 loop 自己管理，建立和关闭都不用再跨线程
+    std::unordered_map<uint64_t, PtrConnection> _conns;
+    std::atomic<size_t> _conn_count; // _conns 的大小，其他线程也可以读
+    std::shared_ptr<UpstreamPool> _upstream; // 这个 loop 的上游连接池，第一次使用时创建
 private:
     void RunAllTask()
     {
@@ -881,7 +1176,8 @@ public:
         : _thread_id(std::this_thread::get_id()),
           _event_fd(CreateEventFd()),
           _eventfd_channel(new Channel(this, _event_fd)),
-          _timer_wheel(this)
+          _timer_wheel(this),
+          _timer_seq(0), _conn_count(0)
     {
         // 给eventfd添加可读事件回调函数，读取eventfd事件通知次数
         _eventfd_channel->SetReadCallback(std::bind(&EventLoop::ReadEventfd, this));
@@ -905,6 +1201,8 @@ public:
             }
             // 3. 执行任务
             RunAllTask();
+            // 4. 发送本轮积累的数据: 每个连接只发送一次
+            FlushPending();
         }
     }
     // 虽然说是Loop, 其实是判断任务是否是在当前EventLoop绑定的线程里
@@ -937,6 +1235,33 @@ public:
         WeakUpEventFd();
     }
 
+    // 登记一个有待发送数据的连接，本轮循环结束时统一发送(只能在 loop 线程中调用)
+    void AddPendingFlush(const PtrConnection &conn)
+    {
+        _pending_flush.push_back(conn);
+    }
+    // Connection 在后面定义，这里先声明
+    void FlushPending();
+    SlabPool *ConnectionSlab() { return &_conn_slab; }
+    // 连接管理，以下接口只能在 loop 线程中调用
+    void AddConnection(const PtrConnection &conn);
+    void RemoveConnection(uint64_t id)
+    {
+        auto it = _conns.find(id);
+        if (it == _conns.end())
+            return;
+        _conns.erase(it);
+        _conn_count.store(_conns.size(), std::memory_order_relaxed);
+    }
+    void ForEachConnection(const std::function<void(const PtrConnection &)> &cb)
+    {
+        for (auto &it : _conns)
+            cb(it.second);
+    }
+    // 当前 loop 上的连接数，可以在任意线程调用
+    size_t ConnectionCount() { return _conn_count.load(std::memory_order_relaxed); }
+    // 这个 loop 的上游连接池(UpstreamPool 在后面定义)，只能在 loop 线程中使用
+    UpstreamPool *Upstream();
     // 添加 / 修改描述符的监控事件
     void UpdateEvent(Channel *channel)
     {
@@ -954,10 +1279,60 @@ public:
     void TimerRefresh(uint64_t id) { return _timer_wheel.TimerRefresh(id); }
     void TimerCancel(uint64_t id) { return _timer_wheel.TimerCancel(id); }
     bool HasTimer(uint64_t id) { return _timer_wheel.HasTimer(id); }
+    // 添加一个 delay 秒后执行的内部定时任务，ID 由 loop 自己分配; delay 为 0 时放进任务队列，本轮循环就执行
+    void RunAfter(const TaskFunc &cb, uint32_t delay)
+    {
+        if (delay == 0)
+            return QueueInLoop(cb);
+        uint64_t id = (1ULL << 63) | ++_timer_seq;
+        TimerAdd(id, delay, cb);
+    }
+#ifdef HAS_COROUTINE
+    // co_await loop->AsyncSleep(sec): 挂起当前协程，sec 秒后在本 loop 线程恢复（精度与时间轮一致，按秒）
+    struct SleepAwaiter
+    {
+        EventLoop *_loop;
+        uint32_t _delay;
+        bool await_ready() { return _delay == 0; }
+        void await_suspend(std::coroutine_handle<> h)
+        {
+            _loop->RunAfter([h]()
+                            { h.resume(); },
+                            _delay);
+        }
+        void await_resume() {}
+    };
+    SleepAwaiter AsyncSleep(uint32_t sec) { return SleepAwaiter{this, sec}; }
+    // co_await loop->Schedule(): 把当前协程切换到这个 loop 线程上继续执行
+    // 可以用来把耗时计算挪到别的线程，再切回连接所在的 loop
+    struct ScheduleAwaiter
+    {
+        EventLoop *_loop;
+        bool await_ready() { return false; }
+        void await_suspend(std::coroutine_handle<> h)
+        {
+            _loop->QueueInLoop([h]()
+                               { h.resume(); });
+        }
+        void await_resume() {}
+    };
+    ScheduleAwaiter Schedule() { return ScheduleAwaiter{this}; }
+#endif
 };
 
-void Channel::Update() { return _loop->UpdateEvent(this); }
-void Channel::Remove() { return _loop->RemoveEvent(this); }
+void Channel::Update()
+{
+    if (_registered && _events == _committed_events)
+        return; // 事件没变，省掉一次 epoll_ctl(MOD)
+    _registered = true;
+    _committed_events = _events;
+    return _loop->UpdateEvent(this);
+}
+void Channel::Remove()
+{
+    _registered = false;
+    return _loop->RemoveEvent(this);
+}
 
 void TimeWheel::TimerAdd(uint64_t id, uint32_t delay, const TaskFunc &cb)
 {
@@ -973,6 +1348,90 @@ void TimeWheel::TimerCancel(uint64_t id)
     _loop->RunInLoop(std::bind(&TimeWheel::TimerCancelInLoop, this, id));
 }
 
+#ifdef HAS_COROUTINE
+// 协程任务类型: 协程体在第一次 Start() 或被 co_await 时才开始执行
+// 1. 作为顶层任务: task.Start() 后与 CoTask 对象分离，执行结束后协程帧自己销毁
+// 2. 作为子任务: co_await task，子任务结束后恢复父协程，帧由 CoTask 对象析构时销毁
+// 除了编译器分配的协程帧之外不做额外的内存分配
+class CoTask
+{
+public:
+    struct promise_type
+    {
+        std::coroutine_handle<> _continuation; // 等待本任务结束的父协程
+        bool _detached = false;                // 是否已经与 CoTask 对象分离
+
+        struct FinalAwaiter
+        {
+            bool await_ready() noexcept { return false; }
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> h) noexcept
+            {
+                std::coroutine_handle<> next = h.promise()._continuation;
+                if (h.promise()._detached)
+                    h.destroy(); // 顶层任务没人持有，结束时自己释放
+                if (next)
+                    return next; // 对称转移，直接恢复父协程
+                return std::noop_coroutine();
+            }
+            void await_resume() noexcept {}
+        };
+        CoTask get_return_object() { return CoTask(std::coroutine_handle<promise_type>::from_promise(*this)); }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        FinalAwaiter final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception()
+        {
+            ERR_LOG("COROUTINE UNHANDLED EXCEPTION!");
+            abort();
+        }
+    };
+
+private:
+    std::coroutine_handle<promise_type> _handle;
+
+public:
+    CoTask() = default;
+    explicit CoTask(std::coroutine_handle<promise_type> h) : _handle(h) {}
+    CoTask(CoTask &&other) noexcept : _handle(std::exchange(other._handle, nullptr)) {}
+    CoTask &operator=(CoTask &&other) noexcept
+    {
+        if (this != &other)
+        {
+            if (_handle)
+                _handle.destroy();
+            _handle = std::exchange(other._handle, nullptr);
+        }
+        return *this;
+    }
+    CoTask(const CoTask &) = delete;
+    CoTask &operator=(const CoTask &) = delete;
+    ~CoTask()
+    {
+        if (_handle)
+            _handle.destroy();
+    }
+    bool Valid() { return (bool)_handle; }
+    bool Done() { return _handle && _handle.done(); }
+    // 作为顶层任务启动，之后协程帧的生命周期由协程自己管理
+    void Start()
+    {
+        if (!_handle)
+            return;
+        std::coroutine_handle<promise_type> h = std::exchange(_handle, nullptr);
+        h.promise()._detached = true;
+        h.resume();
+    }
+    // co_await 子任务
+    bool await_ready() { return !_handle || _handle.done(); }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> h)
+    {
+        _handle.promise()._continuation = h;
+        return _handle;
+    }
+    void await_resume() {}
+};
+#endif
+
 typedef enum
 {
     DISCONNECTED,  // -- 关闭状态
@@ -980,46 +1439,462 @@ typedef enum
     CONNECTING,    // -- 连接建立成功 - 待处理状态
     CONNECTED      // -- 连接建立完成，各种设置已经完成，可以通信的状态
 } ConnStatu;
-class Connection;
-using PtrConnection = std::shared_ptr<Connection>;
+// 发送缓冲区水位: 超过高水位说明对端读得太慢，可以暂停读取对端的数据(不再产生新的响应)，降到低水位以下再恢复
+#define DEFAULT_HIGH_WATER_MARK (64 * 1024 * 1024)
+#define DEFAULT_LOW_WATER_MARK (16 * 1024 * 1024)
+// 暂停读取的原因(位掩码): 每个原因各自暂停 / 恢复，互不影响，全部解除之后才重新开始读
+#define READ_PAUSE_USER 0x1       // PauseRead() 没有指定原因时
+#define READ_PAUSE_WATER_MARK 0x2 // 发送缓冲区超过高水位(背压)
+#define READ_PAUSE_CUSTOM 0x100   // 上层自己定义的原因从这里开始，比如 READ_PAUSE_CUSTOM << 1
+// 流式发送: 发送缓冲区低于这个大小时，向数据生产者拉取下一块数据
+#define PRODUCER_REFILL_SIZE (64 * 1024)
+// 这几个回调函数，是让服务器模块来设置的（其实服务器模块的处理回调也是组件使用者设置的）
+// 换句话说，这几个回调都是组件使用者使用的
+using ConnectedCallback = std::function<void(const PtrConnection &)>;
+using MessageCallback = std::function<void(const PtrConnection &, Buffer *)>;
+using ClosedCallback = std::function<void(const PtrConnection &)>;
+using AnyEventCallback = std::function<void(const PtrConnection &)>;
+using WaterMarkCallback = std::function<void(const PtrConnection &, size_t)>; // 第二个参数是当前发送缓冲区大小
+using WriteCompleteCallback = std::function<void(const PtrConnection &)>;
+// 一个连接用到的全部回调。服务器上的连接回调都一样，所有连接共享服务器的这一份，
+// 不用每个新连接都拷贝一遍 std::function(拷贝 std::bind 出来的对象都要堆分配)
+// 只有某个连接单独修改回调(比如协议升级)时，才给它拷贝一份自己的
+struct ConnectionCallbacks
+{
+    ConnectedCallback _connected;          // 建立连接回调函数
+    MessageCallback _message;              // 业务处理回调函数
+    ClosedCallback _closed;                // 关闭连接回调函数
+    AnyEventCallback _event;               // 任意事件回调函数
+    // 组件内的连接关闭回调--组件内设置的，因为服务器组件内会把所有的连接管理起来
+    // 一旦某个连接要关闭就应该从管理的地方移除掉自己的信息
+    ClosedCallback _server_closed;
+    WaterMarkCallback _high_water;         // 发送缓冲区涨过高水位时调用
+    WaterMarkCallback _low_water;          // 发送缓冲区从高水位降到低水位时调用
+    WriteCompleteCallback _write_complete; // 发送缓冲区里的数据全部写入内核时调用
+};
+using PtrCallbacks = std::shared_ptr<ConnectionCallbacks>;
+
+#define OUTPUT_IOV_MAX 64            // 发送链一次最多聚集写多少段
+#define OUTPUT_FILE_CHUNK (64 * 1024) // 文件段不能 sendfile 时(TLS 不在内核)，每次读进发送缓冲区的大小
+// 发送链上的一段数据(发送缓冲区之后的部分)
+// 引用段: 直接引用外部的数据(比如 HTTP 响应的正文)，holder 保证数据在发送完之前不被释放，不用拷贝进发送缓冲区
+// 缓冲段: 排在引用段后面写入的普通数据
+// 文件段: 文件 fd 从 offset 开始的 len 字节，用 sendfile 发送，holder 保证发送完之前文件不被关闭
+struct OutputSegment
+{
+    std::shared_ptr<const void> holder; // 为空表示缓冲段
+    const char *data;
+    size_t len;
+    int fd; // >= 0 表示文件段
+    off_t offset;
+    Buffer buf;
+
+    OutputSegment() : data(nullptr), len(0), fd(-1), offset(0) {}
+    OutputSegment(std::shared_ptr<const void> h, const char *d, size_t l) : holder(std::move(h)), data(d), len(l), fd(-1), offset(0) {}
+    OutputSegment(std::shared_ptr<const void> h, int f, off_t off, size_t l) : holder(std::move(h)), data(nullptr), len(l), fd(f), offset(off) {}
+    bool IsFile() { return fd >= 0; }
+    size_t Size() { return holder ? len : buf.ReadAbleSize(); }
+    const char *Data() { return holder ? data : buf.ReadAddr(); }
+    void Consume(size_t n)
+    {
+        if (holder == nullptr)
+            return buf.MoveReaderOffset(n);
+        if (IsFile())
+            offset += n;
+        else
+            data += n;
+        len -= n;
+    }
+};
+
 // 用来整合和调用前面的模块，实现对单个连接的整体描述，同时给使用者提供更方便的接口
+// 对象由所属 loop 的 SlabPool 分配(见 Create)，成员按访问频率排列:
+// 每次读写事件都要访问的热数据放在前面，集中在开头几个 cache line; 回调、上下文等很少访问的冷数据放在后面
 class Connection : public std::enable_shared_from_this<Connection>
 {
+    friend class EventLoop; // EventLoop 在一轮循环结束时调用 FlushInLoop
     // 继承一个模板类，得到有weak_ptr对象，后续可以用 shared_from_this() 得到自身的 shared_ptr 对象
 private:
-    int _conn_id; // 连接的唯一 ID，便于连接的管理和查找 (同时，可以用来当做定时器 ID)
+    // 数据生产者: 套接字可写且发送缓冲区快空的时候被调用，把下一块数据直接写进发送缓冲区
+    // 返回 true 表示后面还有数据，返回 false 表示数据已经全部生产完
+    using WriteProducer = std::function<bool(Buffer *)>;
+
+    // ---- 热数据 ----
+    EventLoop *_loop;
+    uint64_t _conn_id; // 连接的唯一 ID，便于连接的管理和查找 (同时，可以用来当做定时器 ID)
     int _sockfd;
+    ConnStatu _status;
     bool _enable_inactive_release; // 连接是否启动非活跃销毁的判断标志，默认为 false
-    EventLoop *_loop;
-    Channel _channel;
+    bool _pause_read_on_high;      // 超过高水位时是否暂停读
+    bool _above_high;              // 当前是否处于高水位之上
+    uint32_t _read_paused;         // 读事件监控被暂停的原因(READ_PAUSE_*)，0 表示没有暂停
+    bool _corked;                  // 应用层 cork: 为 true 时数据只进发送缓冲区，直到 Uncork 才发送
+    bool _flush_scheduled;         // 是否已经登记到 loop 的待发送列表
+    bool _producer_idle;           // 生产者上次没有给出数据，等待 ResumeProducer
     Socket _socket;
-    ConnStatu _status;
     Buffer _in_buffer; // (针对网络连接的数据暂存区)单次读取到的数可能是不完整的，所以需要缓冲区来临时存储
-    Buffer _out_buffer;
-    std::any _context; // 上下文: 保存当前的状态, 解析阶段等...信息
-
-    // 这四个回调函数，是让服务器模块来设置的（其实服务器模块的处理回调也是组件使用者设置的）
-    // 换句话说，这几个回调都是组件使用者使用的*/
-    using ConnectedCallback = std::function<void(const PtrConnection &)>;
-    using MessageCallback = std::function<void(const PtrConnection &, Buffer *)>;
-    using ClosedCallback = std::function<void(const PtrConnection &)>;
-    using AnyEventCallback = std::function<void(const PtrConnection &)>;
-    ConnectedCallback _connected_callback; // 建立连接回调函数
-    MessageCallback _message_callback;     // 业务处理回调函数
-    ClosedCallback _closed_callback;       // 关闭连接回调函数
-    AnyEventCallback _event_callback;      // 任意事件回调函数
-    // 组件内的连接关闭回调--组件内设置的，因为服务器组件内会把所有的连接管理起来
-    // 一旦某个连接要关闭就应该从管理的地方移除掉自己的信息
-    ClosedCallback _server_closed_callback;
+    Buffer _out_buffer; // 发送缓冲区，也是发送链的第一段
+    std::vector<OutputSegment> _out_chain; // 发送链的后续部分，通常为空(只有按引用发送时才有)
+    // 输出背压
+    size_t _high_water_mark; // 发送缓冲区高水位，0 表示不检查
+    size_t _low_water_mark;  // 发送缓冲区低水位
+    size_t _max_out_buffer;  // 慢消费者上限: 发送缓冲区超过这个大小直接断开连接，0 表示不限制
+    Channel _channel;
+
+    // ---- 冷数据 ----
+    PtrCallbacks _callbacks;  // 回调函数，默认和服务器上其他连接共享
+    WriteProducer _producer;  // 流式发送的数据生产者，没有则为空
+    std::any _context;        // 上下文: 保存当前的状态, 解析阶段等...信息
+#ifdef ENABLE_TLS
+    SSL *_ssl;              // 开启 TLS 的连接才有
+    bool _tls_handshaking;  // 握手还没完成，期间不收发应用数据
+#endif
+#ifdef HAS_COROUTINE
+    std::coroutine_handle<> _read_waiter;  // 正在等待新数据的协程
+    std::coroutine_handle<> _write_waiter; // 正在等待发送缓冲区清空的协程
+#endif
 
 private:
+    // 有新数据时通知上层: 有协程在等数据就恢复协程，否则调用业务处理回调
+    void NotifyMessage()
+    {
+#ifdef HAS_COROUTINE
+        if (_read_waiter)
+            return std::exchange(_read_waiter, nullptr).resume();
+#endif
+        if (_callbacks && _callbacks->_message)
+            _callbacks->_message(shared_from_this(), &_in_buffer);
+    }
+    // 发送缓冲区清空 / 连接释放时，恢复等待发送完成的协程
+    void NotifyWriteDone()
+    {
+#ifdef HAS_COROUTINE
+        if (_write_waiter)
+            std::exchange(_write_waiter, nullptr).resume();
+#endif
+    }
+    // 待发送的数据总量: 发送缓冲区 + 发送链
+    size_t PendingOutput()
+    {
+        size_t size = _out_buffer.ReadAbleSize();
+        for (auto &seg : _out_chain)
+            size += seg.Size();
+        return size;
+    }
+    // 待发送数据中占着内存的部分(不包括文件段)，高低水位按它计算
+    size_t BufferedOutput()
+    {
+        size_t size = _out_buffer.ReadAbleSize();
+        for (auto &seg : _out_chain)
+        {
+            if (seg.IsFile() == false)
+                size += seg.Size();
+        }
+        return size;
+    }
+    // 新写入的数据追加到发送链的末尾，保证和引用段的先后顺序
+    Buffer *TailBuffer()
+    {
+        if (_out_chain.empty())
+            return &_out_buffer;
+        if (_out_chain.back().holder)
+            _out_chain.emplace_back();
+        return &_out_chain.back().buf;
+    }
+    // 已经发送了 len 字节: 依次从发送缓冲区和发送链的前面移除
+    void ConsumeOutput(size_t len)
+    {
+        size_t n = std::min(len, (size_t)_out_buffer.ReadAbleSize());
+        _out_buffer.MoveReaderOffset(n);
+        len -= n;
+        size_t done = 0;
+        for (; done < _out_chain.size(); done++)
+        {
+            n = std::min(len, _out_chain[done].Size());
+            _out_chain[done].Consume(n);
+            len -= n;
+            if (_out_chain[done].Size() > 0)
+                break;
+        }
+        _out_chain.erase(_out_chain.begin(), _out_chain.begin() + done);
+        // 发送缓冲区空了，后面紧跟着的缓冲段直接换上来，发送链恢复成只有一段的常见情况
+        if (_out_buffer.ReadAbleSize() == 0 && _out_chain.empty() == false && _out_chain.front().holder == nullptr)
+        {
+            std::swap(_out_buffer, _out_chain.front().buf);
+            _out_chain.erase(_out_chain.begin());
+        }
+    }
+    // 发送链最前面是不是文件段(前面的数据都已经发完)
+    bool FileAtFront() { return _out_buffer.ReadAbleSize() == 0 && _out_chain.empty() == false && _out_chain.front().IsFile(); }
+    // 发送内存中的数据(发送缓冲区和后面的引用段/缓冲段，遇到文件段为止)，want 返回尝试发送的字节数
+    ssize_t SendMemory(size_t *want)
+    {
+#ifdef ENABLE_TLS
+        if (_ssl)
+        {
+            // OpenSSL 没有聚集写，只写最前面的一段
+            const char *data = _out_buffer.ReadAddr();
+            size_t len = _out_buffer.ReadAbleSize();
+            if (len == 0)
+            {
+                data = _out_chain.front().Data();
+                len = _out_chain.front().Size();
+            }
+            *want = len;
+            return TlsSend(data, len);
+        }
+#endif
+        if (_out_chain.empty())
+        {
+            *want = _out_buffer.ReadAbleSize();
+            return _socket.NonBlockSend(_out_buffer.ReadAddr(), _out_buffer.ReadAbleSize());
+        }
+        // 发送缓冲区和引用段一次 sendmsg 发出去，正文不用先拷贝到发送缓冲区
+        struct iovec iov[OUTPUT_IOV_MAX];
+        int cnt = 0;
+        bool more = false;
+        *want = 0;
+        if (_out_buffer.ReadAbleSize() > 0)
+            iov[cnt++] = {_out_buffer.ReadAddr(), (size_t)_out_buffer.ReadAbleSize()};
+        for (auto &seg : _out_chain)
+        {
+            if (cnt == OUTPUT_IOV_MAX)
+                break;
+            if (seg.IsFile())
+            {
+                more = true; // 头部后面紧跟着文件内容，和文件的第一块攒成满的包再发
+                break;
+            }
+            if (seg.Size() > 0)
+                iov[cnt++] = {(void *)seg.Data(), seg.Size()};
+        }
+        for (int i = 0; i < cnt; i++)
+            *want += iov[i].iov_len;
+        return _socket.NonBlockSendv(iov, cnt, more);
+    }
+    // 发送最前面的文件段: 没有开启 TLS 或者 TLS 已经交给内核(kTLS)时直接 sendfile
+    ssize_t SendFileSegment(OutputSegment &seg)
+    {
+#ifdef ENABLE_TLS
+        if (_ssl)
+        {
+#ifndef OPENSSL_NO_KTLS
+            if (TlsKernelSend())
+                return TlsSendFile(seg.fd, seg.offset, seg.len);
+#endif
+            return 0;
+        }
+#endif
+        return _socket.NonBlockSendFile(seg.fd, seg.offset, seg.len);
+    }
+    // 文件段不能直接发送(TLS 在用户态加密): 读一块到发送缓冲区，按普通数据发送，返回 false 表示读文件失败
+    bool LoadFileChunk()
+    {
+        OutputSegment &seg = _out_chain.front();
+        size_t len = std::min(seg.len, (size_t)OUTPUT_FILE_CHUNK);
+        _out_buffer.EnsureWriteAble(len);
+        ssize_t n = pread(seg.fd, _out_buffer.WirteAddr(), len, seg.offset);
+        if (n < 0 && errno == EINTR)
+            return true;
+        if (n <= 0)
+        {
+            // 文件被截断或者读出错，已经承诺的长度发不出来了
+            ERR_LOG("READ FILE FAILED, CONNECTION %lu, %zu BYTES LEFT", _conn_id, seg.len);
+            return false;
+        }
+        _out_buffer.MoveWriterOffset(n);
+        seg.Consume(n);
+        if (seg.Size() == 0)
+            _out_chain.erase(_out_chain.begin()); // 读完了，文件马上可以关闭
+        return true;
+    }
+    // 把待发送的数据尽量多地交给内核，返回发送的字节数(已经从发送链上移除)，<0 表示出错
+    // 内存中的数据聚集写，文件段 sendfile，直到全部发完或者套接字写不下
+    ssize_t SendOutput()
+    {
+        ssize_t ret = 0;
+        while (PendingOutput() > 0)
+        {
+            size_t want = 0;
+            ssize_t n = 0;
+            if (FileAtFront())
+            {
+                want = _out_chain.front().len;
+#ifdef ENABLE_TLS
+                if (_ssl && TlsKernelSend() == false)
+                {
+                    if (LoadFileChunk() == false)
+                        return -1;
+                    continue;
+                }
+#endif
+                n = SendFileSegment(_out_chain.front());
+            }
+            else
+                n = SendMemory(&want);
+            if (n < 0)
+                return -1;
+            ConsumeOutput(n);
+            ret += n;
+            if ((size_t)n < want)
+                break;
+        }
+        return ret;
+    }
+    // 收发数据: 开启 TLS 的连接经过 OpenSSL，否则直接读写套接字
+    // 返回值和 Socket 的一致: >0 表示读写的字节数，0 表示暂时不能读写，<0 表示出错或对端关闭
+    ssize_t TransportRecv(char *buf, size_t len)
+    {
+#ifdef ENABLE_TLS
+        if (_ssl)
+            return TlsRecv(buf, len);
+#endif
+        return _socket.NonBlockRecv(buf, len);
+    }
+    ssize_t TransportSend(const char *data, size_t len)
+    {
+#ifdef ENABLE_TLS
+        if (_ssl)
+            return TlsSend(data, len);
+#endif
+        return _socket.NonBlockSend(data, len);
+    }
+#ifdef ENABLE_TLS
+    // 一次尽量多读几个 TLS 记录，直到填满 buf 或者没有数据
+    ssize_t TlsRecv(char *buf, size_t len)
+    {
+        size_t total = 0;
+        while (total < len)
+        {
+            ERR_clear_error();
+            int n = SSL_read(_ssl, buf + total, len - total);
+            if (n > 0)
+            {
+                total += n;
+                continue;
+            }
+            int err = SSL_get_error(_ssl, n);
+            if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE)
+                break;
+            if (err == SSL_ERROR_SYSCALL && (errno == EAGAIN || errno == EINTR))
+                break;
+            if (err != SSL_ERROR_ZERO_RETURN && err != SSL_ERROR_SYSCALL) // 对端关闭不算错误
+                ERR_LOG("SSL_read FAILED: %s", ERR_reason_error_string(ERR_get_error()));
+            if (total > 0)
+                break; // 先把已经读到的数据交给上层，下次再报告关闭
+            return -1;
+        }
+        return total;
+    }
+    ssize_t TlsSend(const char *data, size_t len)
+    {
+        if (len == 0)
+            return 0;
+        ERR_clear_error();
+        int n = SSL_write(_ssl, data, len);
+        if (n > 0)
+            return n;
+        int err = SSL_get_error(_ssl, n);
+        if (err == SSL_ERROR_WANT_WRITE || err == SSL_ERROR_WANT_READ)
+            return 0;
+        if (err == SSL_ERROR_SYSCALL && (errno == EAGAIN || errno == EINTR))
+            return 0;
+        ERR_LOG("SSL_write FAILED: %s", ERR_reason_error_string(ERR_get_error()));
+        return -1;
+    }
+    // 非阻塞握手，在读写事件里推进; 握手完成才算连接建立(调用连接建立回调)
+    void TlsHandshake()
+    {
+        ERR_clear_error();
+        int ret = SSL_do_handshake(_ssl);
+        if (ret == 1)
+        {
+            _tls_handshaking = false;
+            DBG_LOG("TLS HANDSHAKE DONE: %s, KTLS SEND %d RECV %d, SESSION REUSED %d", SSL_get_version(_ssl),
+                    (int)TlsKernelSend(), (int)TlsKernelRecv(), (int)SSL_session_reused(_ssl));
+            // 握手期间缓存的待发送数据现在可以发了
+            if (PendingOutput() > 0 || _producer)
+                _channel.EnableWrite();
+            else
+                _channel.DisableWrite();
+            if (_callbacks && _callbacks->_connected)
+                _callbacks->_connected(shared_from_this());
+            // 跟在握手后面的应用数据可能已经被 OpenSSL 读进来了，不会再触发可读事件
+            if (_status == CONNECTED && SSL_pending(_ssl) > 0)
+                HandleRead();
+            return;
+        }
+        int err = SSL_get_error(_ssl, ret);
+        if (err == SSL_ERROR_WANT_READ)
+            return _channel.DisableWrite();
+        if (err == SSL_ERROR_WANT_WRITE)
+            return _channel.EnableWrite();
+        ERR_LOG("TLS HANDSHAKE FAILED: %s", ERR_reason_error_string(ERR_get_error()));
+        Release();
+    }
+#ifndef OPENSSL_NO_KTLS
+    ssize_t TlsSendFile(int fd, off_t offset, size_t len)
+    {
+        ERR_clear_error();
+        ossl_ssize_t n = SSL_sendfile(_ssl, fd, offset, len, 0);
+        if (n > 0)
+            return n;
+        if (n == 0 && len > 0)
+        {
+            // 和 NonBlockSendFile 一样: 文件被截断，读到了末尾
+            ERR_LOG("SSL_sendfile REACHED EOF, CONNECTION %lu, %zu BYTES LEFT", _conn_id, len);
+            return -1;
+        }
+        int err = SSL_get_error(_ssl, n);
+        if (err == SSL_ERROR_WANT_WRITE || err == SSL_ERROR_WANT_READ)
+            return 0;
+        if (err == SSL_ERROR_SYSCALL && (errno == EAGAIN || errno == EINTR))
+            return 0;
+        ERR_LOG("SSL_sendfile FAILED: %s", ERR_reason_error_string(ERR_get_error()));
+        return -1;
+    }
+#endif
+    // 一次最多读 64KB，OpenSSL 里可能还留着已经解密、没有读出来的数据; 套接字上没有新数据就不会再触发可读事件，
+    // 所以放进任务队列里接着读(不在这里循环，免得一个连接占住 loop)
+    void ScheduleTlsRead()
+    {
+        if (!_ssl || _tls_handshaking || _read_paused != 0 || _status != CONNECTED || SSL_pending(_ssl) <= 0)
+            return;
+        PtrConnection self = shared_from_this();
+        _loop->QueueInLoop([self]()
+                           {
+            if (self->_ssl && self->_read_paused == 0 && self->_status == CONNECTED && SSL_pending(self->_ssl) > 0)
+                self->HandleRead(); });
+    }
+    // 发送方向是否已经交给内核(kTLS)，交给内核后文件可以直接 sendfile
+    bool TlsKernelSend()
+    {
+#ifndef OPENSSL_NO_KTLS
+        return BIO_get_ktls_send(SSL_get_wbio(_ssl));
+#else
+        return false;
+#endif
+    }
+    bool TlsKernelRecv()
+    {
+#ifndef OPENSSL_NO_KTLS
+        return BIO_get_ktls_recv(SSL_get_rbio(_ssl));
+#else
+        return false;
+#endif
+    }
+#endif
     // 五个channel的事件回调函数
     // 描述符可读事件触发后调用的函数，接收 socket 数据放到接收缓冲区中，然后调用 _message_callback(业务处理函数)
     void HandleRead()
     {
+#ifdef ENABLE_TLS
+        if (_ssl && _tls_handshaking)
+            return TlsHandshake();
+#endif
         char buf[65536];
         // 非阻塞读取数据：返回值<0表示致命错误（已排除EAGAIN/EINTR等暂时错误）
-        ssize_t ret = _socket.NonBlockRecv(buf, 65536);
+        ssize_t ret = TransportRecv(buf, 65536);
         if (ret < 0)
         {
             // 读操作致命错误（如对方断连），但需先处理可能的残留数据
@@ -1031,33 +1906,48 @@ private:
         // 若缓冲区有数据，触发业务层回调处理（如解析协议、处理请求）
         if (_in_buffer.ReadAbleSize() > 0)
         {
-            // 使用shared_from_this确保回调中Connection对象不被提前释放
-            return _message_callback(shared_from_this(), &_in_buffer);
+            // 回调内使用shared_from_this确保Connection对象不被提前释放
+            NotifyMessage();
         }
+#ifdef ENABLE_TLS
+        ScheduleTlsRead();
+#endif
     }
 
     // 可写事件触发时的回调函数：将发送缓冲区的数据进行发送
     void HandleWrite()
     {
-        // 非阻塞发送输出缓冲区中的数据
-        ssize_t ret = _socket.NonBlockSend(_out_buffer.ReadAddr(), _out_buffer.ReadAbleSize());
+#ifdef ENABLE_TLS
+        if (_ssl && _tls_handshaking)
+            return TlsHandshake();
+#endif
+        // 有数据生产者时，趁套接字可写，先拉取下一块数据
+        PullFromProducer();
+        // 非阻塞发送输出缓冲区(和发送链)中的数据
+        ssize_t ret = SendOutput();
         if (ret < 0)
         {
             // 写操作致命错误（如对方已关闭读端），数据无法送达
             // 优先处理输入缓冲区中未处理的数据（避免业务逻辑丢失）
             if (_in_buffer.ReadAbleSize() > 0)
             {
-                _message_callback(shared_from_this(), &_in_buffer);
+                NotifyMessage();
             }
             // 写流已彻底失效，直接释放连接资源（无需保留）
             return Release();
         }
-        // 移动读偏移，标记已发送的数据
-        _out_buffer.MoveReaderOffset(ret);
+        CheckLowWaterMark();
         // 若输出缓冲区已空，关闭写事件监控（避免epoll反复触发可写事件）
-        if (_out_buffer.ReadAbleSize() == 0)
+        if (PendingOutput() == 0)
         {
+            // 生产者还有数据，保持写事件监控，下次可写时继续拉取
+            if (_producer && _producer_idle == false)
+                return;
             _channel.DisableWrite();
+            // 生产者还没结束(暂时没有数据)，不算发送完成，等它 ResumeProducer
+            if (_producer)
+                return;
+            OnWriteComplete();
             // 若处于半关闭状态（DISCONNECTING），说明所有数据已处理完毕，彻底释放
             if (_status == DISCONNECTING)
             {
@@ -1066,12 +1956,34 @@ private:
         }
         return;
     }
+    // 发送缓冲区里的数据已经全部交给内核
+    void OnWriteComplete()
+    {
+        NotifyWriteDone();
+        if (_callbacks && _callbacks->_write_complete)
+            _callbacks->_write_complete(shared_from_this());
+    }
+    // 发送缓冲区低于 PRODUCER_REFILL_SIZE 时向生产者要数据，保证每个连接只缓存一小块
+    void PullFromProducer()
+    {
+        while (_producer && _producer_idle == false && PendingOutput() < PRODUCER_REFILL_SIZE)
+        {
+            size_t before = PendingOutput();
+            if (_producer(TailBuffer()) == false)
+            {
+                _producer = nullptr; // 数据生产完了
+                break;
+            }
+            if (PendingOutput() == before)
+                _producer_idle = true; // 生产者暂时没有数据
+        }
+    }
     // 连接被断开的回调函数, 连接断开后套接字就无效了，如果还有数据没处理，就处理一下
     void HandleClose()
     {
         if (_in_buffer.ReadAbleSize() > 0) // 还有(请求)数据没处理
         {
-            _message_callback(shared_from_this(), &_in_buffer);
+            NotifyMessage();
         }
         return Release();
     }
@@ -1082,9 +1994,9 @@ private:
         {
             _loop->TimerRefresh(_conn_id); // 延迟释放时间
         }
-        if (_event_callback) // 其他任意事件回调
+        if (_callbacks && _callbacks->_event) // 其他任意事件回调
         {
-            _event_callback(shared_from_this());
+            _callbacks->_event(shared_from_this());
         }
     }
     void HandleError()
@@ -1099,60 +2011,239 @@ private:
         assert(_status == CONNECTING);
         _status = CONNECTED;
         _channel.EnableRead();
-        if (_connected_callback)
-            _connected_callback(shared_from_this());
+#ifdef ENABLE_TLS
+        if (_ssl)
+        {
+            _socket.NonBlock(); // OpenSSL 直接 read/write 描述符，描述符本身要是非阻塞的
+            SSL_set_fd(_ssl, _sockfd);
+            SSL_set_accept_state(_ssl);
+            return TlsHandshake();
+        }
+#endif
+        if (_callbacks && _callbacks->_connected)
+            _callbacks->_connected(shared_from_this());
     }
     // 真正释放连接
     void ReleaseInLoop()
     {
+        // 超时释放和关闭事件可能都投递了释放任务，只处理一次
+        if (_status == DISCONNECTED)
+            return;
         // 1. 修改连接状态，将其置为DISCONNECTED
         _status = DISCONNECTED;
         // 2. 移除连接的事件监控
         _channel.Remove();
+#ifdef ENABLE_TLS
+        // 尽量通知对端 TLS 会话正常结束(close_notify)，发不出去也不等
+        if (_ssl && _tls_handshaking == false)
+        {
+            ERR_clear_error();
+            SSL_shutdown(_ssl);
+        }
+#endif
         // 3. 关闭描述符
         _socket.Close();
         // 4. 如果当前定时器队列中还有定时(销毁)任务，则取消任务
         if (_loop->HasTimer(_conn_id))
             CancelInactiveReleaseInLoop();
+        // 唤醒还在等待读写的协程，它们会看到连接已经断开
+        PtrConnection self = shared_from_this();
+#ifdef HAS_COROUTINE
+        if (_read_waiter)
+            std::exchange(_read_waiter, nullptr).resume();
+#endif
+        NotifyWriteDone();
         // 5. 调用关闭回调函数，避免先移除服务器管理的连接信息导致 Connection 被释放，又去处理 Connection 的错误
-        if (_closed_callback)
-            _closed_callback(shared_from_this());
+        if (_callbacks && _callbacks->_closed)
+            _callbacks->_closed(self);
         // 移除服务器内部管理的连接信息
-        if (_server_closed_callback)
-            _server_closed_callback(shared_from_this());
+        if (_callbacks && _callbacks->_server_closed)
+            _callbacks->_server_closed(self);
     }
     // 只是把数据发送到缓冲区，然后启动写事件监控（此时就启动了发送流程）
     // 底层会由 epoll 监控，触发写事件以后，调用回调函数，即：用 Socket 把数据写入发送套接字的发送缓冲区，最终由内核进行发送
     void SendInLoop(Buffer &buf)
+    {
+        SendDataInLoop(buf.ReadAddr(), buf.ReadAbleSize());
+    }
+    void SendDataInLoop(const char *data, size_t len)
     {
         if (_status == DISCONNECTED)
             return;
-        _out_buffer.WriteBufferAndPush(buf);
-        if (_channel.WriteAble() == false) // 有数据了, 通知写事件就绪了
+        size_t old_size = BufferedOutput();
+        TailBuffer()->WriteAndPush(data, len);
+        OutputAppended(old_size);
+    }
+    void SendSharedInLoop(const std::shared_ptr<const void> &holder, const char *data, size_t len)
+    {
+        if (_status == DISCONNECTED || len == 0)
+            return;
+        size_t old_size = BufferedOutput();
+        _out_chain.emplace_back(holder, data, len);
+        OutputAppended(old_size);
+    }
+    void SendFileInLoop(const std::shared_ptr<const void> &holder, int fd, off_t offset, size_t len)
+    {
+        if (_status == DISCONNECTED || len == 0)
+            return;
+        _out_chain.emplace_back(holder, fd, offset, len);
+        OutputAppended(BufferedOutput()); // 文件段不占内存，不影响水位
+    }
+    // 发送链上追加了数据之后: 检查水位，登记发送
+    void OutputAppended(size_t old_size)
+    {
+        if (CheckHighWaterMark(old_size) == false)
+            return;
+        // 已经在等可写事件的连接，由 HandleWrite 继续发送
+        if (_channel.WriteAble() == true)
+            return;
+        // 不立即发送: 同一轮循环里的多次 Send (比如流水线上的多个响应)合并起来，
+        // 在本轮循环结束时一次系统调用发出去，发不完的部分才启动写事件监控
+        ScheduleFlush();
+    }
+    void ScheduleFlush()
+    {
+        if (_flush_scheduled || _corked)
+            return;
+        _flush_scheduled = true;
+        _loop->AddPendingFlush(shared_from_this());
+    }
+    // 由 EventLoop 在一轮循环结束时调用: 尽量把发送缓冲区里的数据直接发完
+    // 小响应一次系统调用就能发完，不需要启动写事件监控(省两次 epoll_ctl)，也不用等下一轮 EPOLLOUT
+    void FlushInLoop()
+    {
+        _flush_scheduled = false;
+        if (_status == DISCONNECTED || _corked || _channel.WriteAble())
+            return;
+#ifdef ENABLE_TLS
+        if (_ssl && _tls_handshaking)
+            return; // 握手完成后再发送
+#endif
+        if (PendingOutput() > 0)
         {
-            _channel.EnableWrite();
+            ssize_t ret = SendOutput();
+            if (ret < 0)
+            {
+                if (_in_buffer.ReadAbleSize() > 0)
+                    NotifyMessage();
+                return Release(); // 写出错，连接已经不可用
+            }
+            CheckLowWaterMark();
+        }
+        // 没发完(或者还有生产者)，剩下的交给写事件
+        if (PendingOutput() > 0 || _producer)
+            return _channel.EnableWrite();
+        OnWriteComplete();
+        if (_status == DISCONNECTING)
+            Release();
+    }
+    void CorkInLoop() { _corked = true; }
+    void UncorkInLoop()
+    {
+        _corked = false;
+        if (PendingOutput() > 0 && _channel.WriteAble() == false)
+            ScheduleFlush();
+    }
+    // 发送缓冲区增长后检查水位(只算占内存的数据)，返回 false 表示连接因为慢消费者被断开
+    bool CheckHighWaterMark(size_t old_size)
+    {
+        size_t size = BufferedOutput();
+        if (_max_out_buffer > 0 && size > _max_out_buffer)
+        {
+            // 对端长时间不读，继续缓存只会耗尽内存，直接丢弃数据断开连接
+            ERR_LOG("SLOW CONSUMER, CONNECTION %lu OUTPUT %zu BYTES, RELEASE", _conn_id, size);
+            _out_buffer.Clear();
+            _out_chain.clear();
+            Release();
+            return false;
+        }
+        if (_high_water_mark > 0 && old_size < _high_water_mark && size >= _high_water_mark)
+        {
+            _above_high = true;
+            if (_callbacks && _callbacks->_high_water)
+                _callbacks->_high_water(shared_from_this(), size);
+            if (_pause_read_on_high)
+                PauseReadInLoop(READ_PAUSE_WATER_MARK);
         }
+        return true;
+    }
+    // 发送缓冲区减少后检查水位: 降到低水位以下时通知上层，并恢复因为背压暂停的读
+    void CheckLowWaterMark()
+    {
+        if (_above_high == false)
+            return;
+        size_t size = BufferedOutput();
+        if (size > _low_water_mark)
+            return;
+        _above_high = false;
+        if (_callbacks && _callbacks->_low_water)
+            _callbacks->_low_water(shared_from_this(), size);
+        if (_pause_read_on_high)
+            ResumeReadInLoop(READ_PAUSE_WATER_MARK);
+    }
+    void SetProducerInLoop(const WriteProducer &producer)
+    {
+        if (_status == DISCONNECTED)
+            return;
+        _producer = producer;
+        _producer_idle = false;
+        ResumeProducerInLoop();
+    }
+    // 生产者有新数据了: 启动写事件监控，可写时再拉取(不在这里直接拉，避免生产者回调里重入)
+    void ResumeProducerInLoop()
+    {
+        if (_status == DISCONNECTED || !_producer)
+            return;
+        _producer_idle = false;
+        if (_channel.WriteAble() == false)
+            _channel.EnableWrite();
+    }
+    void PauseReadInLoop(uint32_t reason)
+    {
+        if (_status == DISCONNECTED)
+            return;
+        if (_read_paused == 0)
+            _channel.DisableRead();
+        _read_paused |= reason;
+    }
+    void ResumeReadInLoop(uint32_t reason)
+    {
+        if ((_read_paused & reason) == 0 || _status == DISCONNECTED)
+            return;
+        _read_paused &= ~reason;
+        if (_read_paused != 0)
+            return; // 还有别的原因没有解除
+        _channel.EnableRead();
+        // 暂停期间积压在输入缓冲区里的数据，恢复时交给上层处理
+        if (_in_buffer.ReadAbleSize() > 0)
+            NotifyMessage();
+#ifdef ENABLE_TLS
+        ScheduleTlsRead(); // 暂停期间留在 OpenSSL 里的数据同样不会触发可读事件
+#endif
     }
     // 为释放做准备 -- 处理剩余数据的接口
     void ShutdownInLoop()
     {
+        if (_status == DISCONNECTED)
+            return;
         _status = DISCONNECTING; // 半关闭连接状态
         // 处理残余数据
         if (_in_buffer.ReadAbleSize() > 0)
         {
-            if (_message_callback)
-                _message_callback(shared_from_this(), &_in_buffer);
+            NotifyMessage();
         }
-        // 有待发送数据
-        if (_out_buffer.ReadAbleSize() > 0)
+        // 有待发送数据(包括生产者还没生产完的数据): 关闭前要全部发出去，cork 也不再生效
+        _corked = false;
+        if (PendingOutput() > 0 || _producer)
         {
-            if (_channel.WriteAble() == false)
+            // 已经登记了本轮结束时发送的，由 FlushInLoop 发送并在发完后释放
+            if (_channel.WriteAble() == false && (_flush_scheduled == false || _producer))
             {
                 _channel.EnableWrite();
             }
         }
         // 没有待发送数据，直接关闭
-        if (_out_buffer.ReadAbleSize() == 0)
+        if (PendingOutput() == 0 && !_producer)
         {
             // 这才是关闭连接的真正执行层
             Release();
@@ -1185,36 +2276,94 @@ private:
                        const AnyEventCallback &event)
     {
         _context = context;
-        _connected_callback = conn;
-        _message_callback = msg;
-        _closed_callback = closed;
-        _event_callback = event;
+        ConnectionCallbacks *cbs = MutableCallbacks();
+        cbs->_connected = conn;
+        cbs->_message = msg;
+        cbs->_closed = closed;
+        cbs->_event = event;
+    }
+    // 要单独修改这个连接的回调: 如果和别的连接共享着同一份，先拷贝一份自己的(写时拷贝)
+    ConnectionCallbacks *MutableCallbacks()
+    {
+        if (!_callbacks)
+            _callbacks = std::make_shared<ConnectionCallbacks>();
+        else if (_callbacks.use_count() > 1)
+            _callbacks = std::make_shared<ConnectionCallbacks>(*_callbacks);
+        return _callbacks.get();
     }
 
 public:
-    Connection(EventLoop *loop, uint64_t conn_id, int sockfd) : _conn_id(conn_id), _sockfd(sockfd),
-                                                                _enable_inactive_release(false), _loop(loop), _status(CONNECTING), _socket(_sockfd),
-                                                                _channel(loop, _sockfd)
-    {
-        _channel.SetCloseCallback(std::bind(&Connection::HandleClose, this));
-        _channel.SetEventCallback(std::bind(&Connection::HandleEvent, this));
-        _channel.SetReadCallback(std::bind(&Connection::HandleRead, this));
-        _channel.SetWriteCallback(std::bind(&Connection::HandleWrite, this));
-        _channel.SetErrorCallback(std::bind(&Connection::HandleError, this));
+    Connection(EventLoop *loop, uint64_t conn_id, int sockfd) : _loop(loop), _conn_id(conn_id), _sockfd(sockfd), _status(CONNECTING),
+                                                                _enable_inactive_release(false), _pause_read_on_high(true), _above_high(false),
+                                                                _read_paused(0), _corked(false), _flush_scheduled(false), _producer_idle(false),
+                                                                _socket(_sockfd),
+                                                                _high_water_mark(DEFAULT_HIGH_WATER_MARK), _low_water_mark(DEFAULT_LOW_WATER_MARK),
+                                                                _max_out_buffer(0), _channel(loop, _sockfd)
+    {
+#ifdef ENABLE_TLS
+        _ssl = nullptr;
+        _tls_handshaking = false;
+#endif
+        // 只捕获 this 的 lambda 能放进 std::function 的内部存储，不用为每个回调再堆分配一次
+        _channel.SetCloseCallback([this]() { HandleClose(); });
+        _channel.SetEventCallback([this]() { HandleEvent(); });
+        _channel.SetReadCallback([this]() { HandleRead(); });
+        _channel.SetWriteCallback([this]() { HandleWrite(); });
+        _channel.SetErrorCallback([this]() { HandleError(); });
+    }
+    ~Connection()
+    {
+        DBG_LOG("RELEASE CONNECTION:%p", this);
+#ifdef ENABLE_TLS
+        if (_ssl)
+            SSL_free(_ssl);
+#endif
+    }
+    // 在 loop 的内存池里创建连接，对象和引用计数控制块一次分配
+    // 引用计数仍然是 shared_ptr 的原子计数，不换成非原子的侵入式计数: 连接在 baseloop 线程创建后才交给自己的 loop，
+    // 其他线程也可以持有 PtrConnection 调用 Send，HttpBodyWriter 在任意线程里通过 weak_ptr 访问连接
+    static PtrConnection Create(EventLoop *loop, uint64_t conn_id, int sockfd)
+    {
+        return std::allocate_shared<Connection>(SlabAllocator<Connection>(loop->ConnectionSlab()), loop, conn_id, sockfd);
     }
-    ~Connection() { DBG_LOG("RELEASE CONNECTION:%p", this); }
     int Fd() { return _sockfd; }
-    int Id() { return _conn_id; }
+    uint64_t Id() { return _conn_id; }
     bool IsConnected() { return _status == CONNECTED; }
     // 获取上下文，返回的是指针
     std::any *GetContext() { return &_context; }
     // 设置上下文--连接建立完成时进行调用
     void SetContext(const std::any &context) { _context = context; }
-    void SetConnectedCallback(const ConnectedCallback &cb) { _connected_callback = cb; }
-    void SetMessageCallback(const MessageCallback &cb) { _message_callback = cb; }
-    void SetClosedCallback(const ClosedCallback &cb) { _closed_callback = cb; }
-    void SetAnyEventCallback(const AnyEventCallback &cb) { _event_callback = cb; }
-    void SetSrvClosedCallback(const ClosedCallback &cb) { _server_closed_callback = cb; }
+    // 一次设置全部回调，和其他连接共享同一份(服务器给新连接设置回调时用)
+    void SetCallbacks(const PtrCallbacks &cbs) { _callbacks = cbs; }
+    void SetConnectedCallback(const ConnectedCallback &cb) { MutableCallbacks()->_connected = cb; }
+    void SetMessageCallback(const MessageCallback &cb) { MutableCallbacks()->_message = cb; }
+    void SetClosedCallback(const ClosedCallback &cb) { MutableCallbacks()->_closed = cb; }
+    void SetAnyEventCallback(const AnyEventCallback &cb) { MutableCallbacks()->_event = cb; }
+    void SetSrvClosedCallback(const ClosedCallback &cb) { MutableCallbacks()->_server_closed = cb; }
+    void SetHighWaterMarkCallback(const WaterMarkCallback &cb) { MutableCallbacks()->_high_water = cb; }
+    void SetLowWaterMarkCallback(const WaterMarkCallback &cb) { MutableCallbacks()->_low_water = cb; }
+    void SetWriteCompleteCallback(const WriteCompleteCallback &cb) { MutableCallbacks()->_write_complete = cb; }
+    // 设置发送缓冲区水位，high 为 0 表示不检查; pause_read: 超过高水位时是否暂停读
+    // 需要在连接建立(Established)之前设置
+    void SetWaterMark(size_t high, size_t low, bool pause_read = true)
+    {
+        _high_water_mark = high;
+        _low_water_mark = low < high ? low : high;
+        _pause_read_on_high = pause_read;
+    }
+    // 慢消费者策略: 发送缓冲区超过 max_bytes 时断开连接，0 表示不限制
+    void SetMaxOutputBuffer(size_t max_bytes) { _max_out_buffer = max_bytes; }
+    size_t OutputSize() { return PendingOutput(); }
+    size_t InputSize() { return _in_buffer.ReadAbleSize(); }
+#ifdef ENABLE_TLS
+    // 这个连接使用 TLS，要在连接建立(Established)之前设置
+    void EnableTls(TlsContext *ctx)
+    {
+        _ssl = ctx->NewSession();
+        _tls_handshaking = true;
+    }
+    bool IsTls() { return _ssl != nullptr; }
+#endif
 
     // 这些接口可以被外界调用，也就是说可能被其他线程调用，但是通过RunInLoop绑定到指定线程
     // 建立连接
@@ -1226,12 +2375,53 @@ public:
     // 发送数据，将数据放到发送(连接的)缓冲区，启动写事件监控
     void Send(const char *data, size_t len)
     {
+        // 已经在连接所属的线程里: 直接发送，不需要先拷贝一份
+        if (_loop->IsinLoop())
+            return SendDataInLoop(data, len);
         // 外界传入的data，可能是个临时的空间，我们现在只是把发送操作压入了任务池，有可能并没有被立即执行
         // 因此有可能执行的时候，data指向的空间有可能已经被释放了。
         Buffer buf; // 所以, 用 buf 存储好数据
         buf.WriteAndPush(data, len);
         _loop->RunInLoop(std::bind(&Connection::SendInLoop, this, std::move(buf)));
     }
+    // 按引用发送: 不拷贝数据，holder 持有数据直到发送完成，比如
+    //   auto body = std::make_shared<std::string>(std::move(str)); conn->SendShared(body, body->data(), body->size());
+    void SendShared(std::shared_ptr<const void> holder, const char *data, size_t len)
+    {
+        _loop->RunInLoop(std::bind(&Connection::SendSharedInLoop, this, std::move(holder), data, len));
+    }
+    // 零拷贝发送文件 fd 从 offset 开始的 len 字节(排在之前发送的数据后面): 用 sendfile 直接从页缓存发出去，
+    // 开启 TLS 时只有 kTLS 生效才能 sendfile，否则一块一块读出来加密发送
+    // holder 持有打开的文件(比如析构时 close 的对象)，保证发送完之前不被关闭，这一段发完(或者连接释放)就放开
+    void SendFile(std::shared_ptr<const void> holder, int fd, off_t offset, size_t len)
+    {
+        _loop->RunInLoop(std::bind(&Connection::SendFileInLoop, this, std::move(holder), fd, offset, len));
+    }
+    // 协议层直接把数据序列化进发送链(省掉一次拷贝)，只能在 loop 线程中调用:
+    //   Buffer *out = conn->OutputBuffer(); size_t before = out->ReadAbleSize();
+    //   ...往 out 里写...; conn->CommitOutput(out->ReadAbleSize() - before);
+    Buffer *OutputBuffer()
+    {
+        _loop->AssertInLoop();
+        return TailBuffer();
+    }
+    void CommitOutput(size_t written)
+    {
+        _loop->AssertInLoop();
+        if (_status == DISCONNECTED || written == 0)
+            return;
+        OutputAppended(BufferedOutput() - written);
+    }
+    // 应用层 cork: Cork 之后的 Send 只进发送缓冲区，Uncork 时合并成一次发送
+    // 不调用也没关系，同一轮循环里的多次 Send 本来就会合并，这个接口用于跨多轮循环攒数据
+    void Cork()
+    {
+        _loop->RunInLoop(std::bind(&Connection::CorkInLoop, this));
+    }
+    void Uncork()
+    {
+        _loop->RunInLoop(std::bind(&Connection::UncorkInLoop, this));
+    }
     // 主动关闭连接, 但是 Shutdown 只负责启动这个流程，会处理剩余数据... 真正的关闭由Release来
     void Shutdown()
     {
@@ -1252,6 +2442,27 @@ public:
     {
         _loop->RunInLoop(std::bind(&Connection::CancelInactiveReleaseInLoop, this));
     }
+    // 流式发送: 设置数据生产者，之后每当套接字可写并且发送缓冲区快空时，都会调用它拉取下一块数据
+    // 这样发送再大的数据，每个连接也只缓存 PRODUCER_REFILL_SIZE 左右的数据
+    void SetWriteProducer(const WriteProducer &producer)
+    {
+        _loop->RunInLoop(std::bind(&Connection::SetProducerInLoop, this, producer));
+    }
+    // 生产者之前暂时没有数据(返回了 true 但没写入数据)，有数据后调用这个接口继续发送
+    void ResumeProducer()
+    {
+        _loop->RunInLoop(std::bind(&Connection::ResumeProducerInLoop, this));
+    }
+    // 暂停 / 恢复读取对端数据(上层自己做流控时使用): 不同原因用不同的 reason，只恢复自己暂停的那个，
+    // 不会把背压(高水位)或者别的原因暂停的读提前恢复
+    void PauseRead(uint32_t reason = READ_PAUSE_USER)
+    {
+        _loop->RunInLoop(std::bind(&Connection::PauseReadInLoop, this, reason));
+    }
+    void ResumeRead(uint32_t reason = READ_PAUSE_USER)
+    {
+        _loop->RunInLoop(std::bind(&Connection::ResumeReadInLoop, this, reason));
+    }
     // 切换协议---重置上下文以及阶段性回调处理函数 -- 而是这个接口必须在 EventLoop 线程中 立即 执行
     // 防备新的事件触发后，处理的时候，切换任务还没有被执行--会导致数据使用原协议处理了。
     void Upgrade(const std::any &context, const ConnectedCallback &conn, const MessageCallback &msg,
@@ -1260,8 +2471,62 @@ public:
         _loop->AssertInLoop();
         _loop->RunInLoop(std::bind(&Connection::UpgradeInLoop, this, context, conn, msg, closed, event));
     }
+    EventLoop *GetLoop() { return _loop; }
+#ifdef HAS_COROUTINE
+    // 协程接口: 只能在连接所属的 EventLoop 线程中使用，协程也总是在这个线程里被恢复
+    // Buffer *buf = co_await conn->AsyncRead(); 有数据时返回输入缓冲区，连接断开且没有剩余数据时返回 nullptr
+    struct ReadAwaiter
+    {
+        Connection *_conn;
+        bool await_ready() { return _conn->_in_buffer.ReadAbleSize() > 0 || _conn->_status == DISCONNECTED; }
+        void await_suspend(std::coroutine_handle<> h) { _conn->_read_waiter = h; }
+        Buffer *await_resume()
+        {
+            if (_conn->_in_buffer.ReadAbleSize() > 0)
+                return &_conn->_in_buffer;
+            return nullptr;
+        }
+    };
+    ReadAwaiter AsyncRead()
+    {
+        _loop->AssertInLoop();
+        return ReadAwaiter{this};
+    }
+    // bool ok = co_await conn->AsyncSend(data, len); 数据立即拷入发送缓冲区，等缓冲区发完再恢复
+    // 返回 false 表示连接已经断开
+    struct SendAwaiter
+    {
+        Connection *_conn;
+        bool await_ready() { return _conn->PendingOutput() == 0 || _conn->_status == DISCONNECTED; }
+        void await_suspend(std::coroutine_handle<> h) { _conn->_write_waiter = h; }
+        bool await_resume() { return _conn->_status != DISCONNECTED; }
+    };
+    SendAwaiter AsyncSend(const char *data, size_t len)
+    {
+        _loop->AssertInLoop();
+        SendDataInLoop(data, len);
+        return SendAwaiter{this};
+    }
+#endif
 };
 
+void EventLoop::FlushPending()
+{
+    // 发送完成回调里可能又 Send，新登记的连接也在这一轮发掉，避免带着待发送数据阻塞在 epoll_wait
+    while (_pending_flush.empty() == false)
+    {
+        std::vector<PtrConnection> conns;
+        conns.swap(_pending_flush);
+        for (auto &conn : conns)
+            conn->FlushInLoop();
+    }
+}
+void EventLoop::AddConnection(const PtrConnection &conn)
+{
+    _conns.insert(std::make_pair(conn->Id(), conn));
+    _conn_count.store(_conns.size(), std::memory_order_relaxed);
+}
+
 // 单独对监听套接字进行管理
 class Acceptor
 {
@@ -1383,6 +2648,13 @@ public:
         _nxt_idx = (_nxt_idx + 1) % _thread_count;
         return _loops[_nxt_idx];
     }
+    // 所有负责连接的 EventLoop: 没有从属线程时就是主线程
+    std::vector<EventLoop *> AllLoops()
+    {
+        if (_thread_count == 0)
+            return {_baseloop};
+        return _loops;
+    }
 };
 
 // 主线程负责监听与接收新连接，从属线程负责处理连接的 I/O 事件与业务逻辑
@@ -1397,20 +2669,22 @@ private:
     EventLoop _baseloop;                                // 这是主线程的EventLoop对象，负责监听事件的处理
     Acceptor _acceptor;                                 // 这是监听套接字的管理对象
     LoopThreadPool _pool;                               // 这是从属EventLoop线程池
-    std::unordered_map<uint64_t, PtrConnection> _conns; // 管理所有连接对应的shared_ptr对象
+    // 连接由各自所属的 EventLoop 管理(见 EventLoop::AddConnection)，这里只提供汇总的查询接口
 
     // 连接的各种回调函数设置
     // Connection 内部会给回调函数设置固定的动作，外部服务器还可以自己设置回调函数来添加行为
     // 用户自定义的业务回调，是在TcpServer里面提供接口给外部设置的
-    using ConnectedCallback = std::function<void(const PtrConnection &)>;
-    using MessageCallback = std::function<void(const PtrConnection &, Buffer *)>;
-    using ClosedCallback = std::function<void(const PtrConnection &)>;
-    using AnyEventCallback = std::function<void(const PtrConnection &)>;
+    // 所有新连接共享这一份回调，不再给每个连接各拷贝一份
     using Functor = std::function<void()>;
-    ConnectedCallback _connected_callback;
-    MessageCallback _message_callback;
-    ClosedCallback _closed_callback;
-    AnyEventCallback _event_callback;
+    PtrCallbacks _callbacks;
+#ifdef ENABLE_TLS
+    std::shared_ptr<TlsContext> _tls; // 开启 TLS 后所有新连接都先握手
+#endif
+    // 新连接的输出背压设置
+    size_t _high_water_mark;
+    size_t _low_water_mark;
+    bool _pause_read_on_high;
+    size_t _max_out_buffer;
 
 private:
     // 添加定时任务接口
@@ -1419,35 +2693,35 @@ private:
         _next_id++;
         _baseloop.TimerAdd(_next_id, delay, task);
     }
+    // 修改回调: 已经有连接在用当前这一份时，先拷贝一份新的(已建立的连接继续用旧的回调)
+    ConnectionCallbacks *MutableCallbacks()
+    {
+        if (_callbacks.use_count() > 1)
+            _callbacks = std::make_shared<ConnectionCallbacks>(*_callbacks);
+        return _callbacks.get();
+    }
     // 为新连接构造一个Connection进行管理
     void NewConnection(int fd)
     {
         _next_id++;
-        PtrConnection conn(new Connection(_pool.NextLoop(), _next_id, fd));
-        conn->SetMessageCallback(_message_callback);
-        conn->SetClosedCallback(_closed_callback);
-        conn->SetConnectedCallback(_connected_callback);
-        conn->SetAnyEventCallback(_event_callback);
-        conn->SetSrvClosedCallback(std::bind(&TcpServer::RemoveConnection, this, std::placeholders::_1));
+        PtrConnection conn = Connection::Create(_pool.NextLoop(), _next_id, fd);
+        conn->SetCallbacks(_callbacks);
+        conn->SetWaterMark(_high_water_mark, _low_water_mark, _pause_read_on_high);
+        conn->SetMaxOutputBuffer(_max_out_buffer);
+#ifdef ENABLE_TLS
+        if (_tls)
+            conn->EnableTls(_tls.get());
+#endif
         if (_enable_inactive_release)
             conn->EnableInactiveRelease(_timeout); // 启动非活跃超时销毁
         conn->Established();                       // 就绪初始化
-        _conns.insert(std::make_pair(_next_id, conn));
+        EventLoop *loop = conn->GetLoop();
+        loop->RunInLoop(std::bind(&EventLoop::AddConnection, loop, conn));
     }
-    void RemoveConnectionInLoop(const PtrConnection &conn)
-    {
-        int id = conn->Id();
-        auto it = _conns.find(id);
-        if (it != _conns.end())
-        {
-            _conns.erase(it);
-        }
-    }
-    // 从管理Connection的_conns中移除连接信息
-    // 要确保是在指定的线程里的，所以用到RunInLoop，但是具体的操作由RemoveConnectionInLoop接口提供
+    // 从连接所属 loop 的连接表中移除，连接的释放本来就在它的 loop 线程中执行，不用再转到主线程
     void RemoveConnection(const PtrConnection &conn)
     {
-        _baseloop.RunInLoop(std::bind(&TcpServer::RemoveConnectionInLoop, this, conn));
+        conn->GetLoop()->RemoveConnection(conn->Id());
     }
 
 public:
@@ -1455,21 +2729,66 @@ public:
                           _next_id(0),
                           _enable_inactive_release(false),
                           _acceptor(&_baseloop, port),
-                          _pool(&_baseloop)
-    {
+                          _pool(&_baseloop),
+                          _callbacks(std::make_shared<ConnectionCallbacks>()),
+                          _high_water_mark(DEFAULT_HIGH_WATER_MARK),
+                          _low_water_mark(DEFAULT_LOW_WATER_MARK),
+                          _pause_read_on_high(true),
+                          _max_out_buffer(0)
+    {
+        _callbacks->_server_closed = std::bind(&TcpServer::RemoveConnection, this, std::placeholders::_1);
         _acceptor.SetAcceptCallback(std::bind(&TcpServer::NewConnection, this, std::placeholders::_1));
         _acceptor.Listen(); // 将监听套接字挂到baseloop上
     }
     void SetThreadCount(int count) { return _pool.SetThreadCount(count); }
-    void SetConnectedCallback(const ConnectedCallback &cb) { _connected_callback = cb; }
-    void SetMessageCallback(const MessageCallback &cb) { _message_callback = cb; }
-    void SetClosedCallback(const ClosedCallback &cb) { _closed_callback = cb; }
-    void SetAnyEventCallback(const AnyEventCallback &cb) { _event_callback = cb; }
+    // 主线程的 EventLoop(负责监听)，可以把其他需要监控的描述符也挂在上面
+    EventLoop *BaseLoop() { return &_baseloop; }
+    void SetConnectedCallback(const ConnectedCallback &cb) { MutableCallbacks()->_connected = cb; }
+    void SetMessageCallback(const MessageCallback &cb) { MutableCallbacks()->_message = cb; }
+    void SetClosedCallback(const ClosedCallback &cb) { MutableCallbacks()->_closed = cb; }
+    void SetAnyEventCallback(const AnyEventCallback &cb) { MutableCallbacks()->_event = cb; }
+    void SetHighWaterMarkCallback(const WaterMarkCallback &cb) { MutableCallbacks()->_high_water = cb; }
+    void SetLowWaterMarkCallback(const WaterMarkCallback &cb) { MutableCallbacks()->_low_water = cb; }
+    void SetWriteCompleteCallback(const WriteCompleteCallback &cb) { MutableCallbacks()->_write_complete = cb; }
+    // 设置每个连接发送缓冲区的高低水位，high 为 0 表示不检查; pause_read: 超过高水位时暂停读取该连接
+    void SetWaterMark(size_t high, size_t low, bool pause_read = true)
+    {
+        _high_water_mark = high;
+        _low_water_mark = low;
+        _pause_read_on_high = pause_read;
+    }
+    // 慢消费者断开策略: 单个连接待发送数据超过 max_bytes 就断开，0 表示不限制
+    void SetMaxOutputBuffer(size_t max_bytes) { _max_out_buffer = max_bytes; }
     void EnableInactiveRelease(int timeout)
     {
         _timeout = timeout;
         _enable_inactive_release = true;
     }
+#ifdef ENABLE_TLS
+    // 开启 TLS: 加载证书和私钥(PEM 格式)，要在 Start 之前调用
+    bool EnableTls(const std::string &cert_file, const std::string &key_file)
+    {
+        std::shared_ptr<TlsContext> tls = std::make_shared<TlsContext>();
+        if (tls->Init(cert_file, key_file) == false)
+            return false;
+        _tls = tls;
+        return true;
+    }
+#endif
+    // 当前所有连接的数量(各个 loop 的连接数之和，是个近似值)
+    size_t ConnectionCount()
+    {
+        size_t count = 0;
+        for (auto loop : _pool.AllLoops())
+            count += loop->ConnectionCount();
+        return count;
+    }
+    // 遍历所有连接: cb 在每个连接所属的 loop 线程中被调用，可以直接操作连接
+    void ForEachConnection(const std::function<void(const PtrConnection &)> &cb)
+    {
+        for (auto loop : _pool.AllLoops())
+            loop->RunInLoop([loop, cb]() { loop->ForEachConnection(cb); });
+    }
     // 用于添加一个定时任务
     void RunAfter(const Functor &task, int delay)
     {
@@ -1481,4 +2800,721 @@ public:
         _pool.Create();
         _baseloop.Start();
     }
-};
\ No newline at end of file
+};
+
+// 非阻塞连接器: 在 loop 中发起 TCP 连接，不会阻塞 loop 线程
+// 支持连接超时，失败后按指数退避重试; 连接成功后把描述符交给使用者，由使用者创建 Connection
+// Connector 要用 shared_ptr 管理，只能在所属 loop 线程中析构
+#define CONNECT_TIMEOUT 3          // 默认连接超时时间(秒)
+#define CONNECT_RETRY_DELAY 1      // 第一次重试前的等待时间(秒)，之后每次翻倍
+#define CONNECT_RETRY_MAX_DELAY 30 // 重试等待时间的上限(秒)
+#define CONNECT_STABLE_TIME 30     // 连接保持了这么久(秒)才算稳定，断开后重连的等待时间从头开始算
+class Connector : public std::enable_shared_from_this<Connector>
+{
+public:
+    using NewConnectionCallback = std::function<void(int)>; // 参数是已经连上的描述符
+    using ErrorCallback = std::function<void(int)>;         // 重试次数用完仍然失败，参数是最后一次失败的错误码
+
+private:
+    EventLoop *_loop;
+    std::string _ip;
+    uint16_t _port;
+    uint32_t _timeout;     // 单次连接的超时时间(秒)
+    int _max_retry;        // 最大重试次数，-1 表示一直重试
+    int _retry;            // 已经重试的次数
+    uint32_t _retry_delay; // 下一次重试前的等待时间(秒)
+    uint64_t _attempt;     // 第几次发起连接，过期的超时/重试任务据此忽略
+    time_t _connected_at;  // 上一次连上的时间
+    bool _connecting;      // 正在等待连接结果
+    bool _stopped;
+    Socket _socket; // 正在连接的套接字
+    std::unique_ptr<Channel> _channel;
+    NewConnectionCallback _new_conn_callback;
+    ErrorCallback _error_callback;
+
+private:
+    void StartInLoop()
+    {
+        _stopped = false;
+        _retry = 0;
+        _retry_delay = CONNECT_RETRY_DELAY;
+        Connect();
+    }
+    // 连上的连接断开后重连: 不马上连，按重试的等待时间退避; 连接保持得足够久时等待时间才从头开始
+    // 避免对端一连上就关闭(或者过载)时陷入 连接-断开 的死循环
+    void RestartInLoop()
+    {
+        _stopped = false;
+        _retry = 0;
+        if (time(nullptr) - _connected_at >= CONNECT_STABLE_TIME)
+            _retry_delay = CONNECT_RETRY_DELAY;
+        DBG_LOG("CONNECTION TO %s:%d CLOSED, RECONNECT AFTER %u S", _ip.c_str(), _port, _retry_delay);
+        ScheduleConnect();
+    }
+    void StopInLoop()
+    {
+        _stopped = true;
+        _attempt++; // 让还没执行的超时/重试任务失效
+        ResetChannel();
+        _socket.Close();
+    }
+    // 发起一次连接
+    void Connect()
+    {
+        if (_stopped)
+            return;
+        _attempt++;
+        _socket.Close();
+        if (_socket.Create() == false)
+            return Retry(errno);
+        _socket.NonBlock();
+        int err = _socket.NonBlockConnect(_port, _ip);
+        if (err == 0)
+            return Connected();
+        if (err != EINPROGRESS)
+            return Retry(err);
+        // 正在连接: 套接字可写(或出错)时连接有了结果
+        _connecting = true;
+        _channel.reset(new Channel(_loop, _socket.Fd()));
+        _channel->SetWriteCallback([this]() { HandleWrite(); });
+        _channel->SetErrorCallback([this]() { HandleWrite(); });
+        _channel->SetCloseCallback([this]() { HandleWrite(); });
+        _channel->EnableWrite();
+        std::weak_ptr<Connector> weak = shared_from_this();
+        uint64_t attempt = _attempt;
+        _loop->RunAfter([weak, attempt]()
+                        {
+            std::shared_ptr<Connector> self = weak.lock();
+            if (self && self->_connecting && self->_attempt == attempt)
+                self->Timeout(); }, _timeout);
+    }
+    // 停止监控正在连接的套接字
+    // 可能正处在这个 Channel 的事件回调里，所以 Channel 对象放到任务里延后释放
+    void ResetChannel()
+    {
+        _connecting = false;
+        if (!_channel)
+            return;
+        _channel->Remove();
+        std::shared_ptr<Channel> channel(std::move(_channel));
+        _loop->QueueInLoop([channel]() {});
+    }
+    void HandleWrite()
+    {
+        if (_connecting == false)
+            return;
+        ResetChannel();
+        int err = _socket.GetError();
+        if (err != 0)
+            return Retry(err);
+        Connected();
+    }
+    void Timeout()
+    {
+        ResetChannel();
+        Retry(ETIMEDOUT);
+    }
+    // 等待时间不在这里重置: 连接保持够久之后，断开重连时(RestartInLoop)才重置
+    void Connected()
+    {
+        _retry = 0;
+        _connected_at = time(nullptr);
+        int fd = _socket.ReleaseFd();
+        if (_new_conn_callback)
+            return _new_conn_callback(fd);
+        close(fd);
+    }
+    void Retry(int err)
+    {
+        _socket.Close();
+        if (_stopped)
+            return;
+        if (_max_retry >= 0 && _retry >= _max_retry)
+        {
+            ERR_LOG("CONNECT %s:%d FAILED: %s", _ip.c_str(), _port, strerror(err));
+            if (_error_callback)
+                _error_callback(err);
+            return;
+        }
+        _retry++;
+        DBG_LOG("CONNECT %s:%d FAILED: %s, RETRY AFTER %u S", _ip.c_str(), _port, strerror(err), _retry_delay);
+        ScheduleConnect();
+    }
+    // 等待 _retry_delay 秒后再发起连接，下一次的等待时间翻倍
+    void ScheduleConnect()
+    {
+        std::weak_ptr<Connector> weak = shared_from_this();
+        uint64_t attempt = _attempt;
+        _loop->RunAfter([weak, attempt]()
+                        {
+            std::shared_ptr<Connector> self = weak.lock();
+            if (self && self->_attempt == attempt)
+                self->Connect(); }, _retry_delay);
+        _retry_delay = std::min<uint32_t>(_retry_delay * 2, CONNECT_RETRY_MAX_DELAY);
+    }
+
+public:
+    Connector(EventLoop *loop, const std::string &ip, uint16_t port)
+        : _loop(loop), _ip(ip), _port(port), _timeout(CONNECT_TIMEOUT), _max_retry(0), _retry(0),
+          _retry_delay(CONNECT_RETRY_DELAY), _attempt(0), _connected_at(0), _connecting(false), _stopped(true) {}
+    ~Connector()
+    {
+        if (_channel)
+            _channel->Remove();
+    }
+    // 客户端连接的 ID: 次高位置 1，不会和服务器连接的 ID、loop 内部定时任务的 ID 冲突
+    static uint64_t NextConnId()
+    {
+        static std::atomic<uint64_t> seq(0);
+        return (1ULL << 62) | ++seq;
+    }
+    void SetNewConnectionCallback(const NewConnectionCallback &cb) { _new_conn_callback = cb; }
+    void SetErrorCallback(const ErrorCallback &cb) { _error_callback = cb; }
+    // 单次连接超时时间(秒)，时间轮的精度是 1 秒
+    void SetConnectTimeout(uint32_t sec) { _timeout = sec > 0 ? sec : 1; }
+    // 连接失败后的最大重试次数，-1 表示一直重试，默认不重试
+    void SetMaxRetry(int count) { _max_retry = count; }
+    void Start() { _loop->RunInLoop(std::bind(&Connector::StartInLoop, shared_from_this())); }
+    // 连接断开后重连(带退避)
+    void Restart() { _loop->RunInLoop(std::bind(&Connector::RestartInLoop, shared_from_this())); }
+    void Stop() { _loop->RunInLoop(std::bind(&Connector::StopInLoop, shared_from_this())); }
+};
+
+// TCP 客户端: 通过 Connector 异步连接服务器，连上之后和服务器端一样用 Connection 收发数据
+// 可以设置断开后自动重连。TcpClient 只能在所属 loop 线程中析构
+class TcpClient
+{
+private:
+    EventLoop *_loop;
+    std::shared_ptr<Connector> _connector;
+    PtrConnection _conn;     // 当前的连接，没有连上时为空
+    PtrCallbacks _callbacks; // 连接的回调函数
+    bool _reconnect;         // 连接断开后是否自动重连
+    bool _connect;           // 使用者希望保持连接(Disconnect 之后为 false)
+
+private:
+    ConnectionCallbacks *MutableCallbacks()
+    {
+        if (_callbacks.use_count() > 1)
+            _callbacks = std::make_shared<ConnectionCallbacks>(*_callbacks);
+        return _callbacks.get();
+    }
+    void NewConnection(int fd)
+    {
+        _conn = Connection::Create(_loop, Connector::NextConnId(), fd);
+        _conn->SetCallbacks(_callbacks);
+        _conn->Established();
+        _loop->AddConnection(_conn);
+    }
+    void RemoveConnection(const PtrConnection &conn)
+    {
+        _loop->RemoveConnection(conn->Id());
+        if (_conn == conn)
+            _conn.reset();
+        if (_reconnect && _connect)
+            _connector->Restart();
+    }
+    void ConnectInLoop()
+    {
+        _connect = true;
+        if (!_conn)
+            _connector->Start();
+    }
+    void DisconnectInLoop()
+    {
+        _connect = false;
+        if (_conn)
+            _conn->Shutdown();
+        else
+            _connector->Stop();
+    }
+
+public:
+    TcpClient(EventLoop *loop, const std::string &ip, uint16_t port)
+        : _loop(loop), _connector(std::make_shared<Connector>(loop, ip, port)),
+          _callbacks(std::make_shared<ConnectionCallbacks>()), _reconnect(false), _connect(false)
+    {
+        _callbacks->_server_closed = std::bind(&TcpClient::RemoveConnection, this, std::placeholders::_1);
+        _connector->SetNewConnectionCallback(std::bind(&TcpClient::NewConnection, this, std::placeholders::_1));
+    }
+    ~TcpClient()
+    {
+        _connector->SetNewConnectionCallback(nullptr);
+        _connector->Stop();
+        if (_conn)
+        {
+            // 连接可能比 TcpClient 活得久，关闭时不能再回调到 TcpClient
+            EventLoop *loop = _loop;
+            _conn->SetSrvClosedCallback([loop](const PtrConnection &conn)
+                                        { loop->RemoveConnection(conn->Id()); });
+            _conn->Shutdown();
+        }
+    }
+    void SetConnectedCallback(const ConnectedCallback &cb) { MutableCallbacks()->_connected = cb; }
+    void SetMessageCallback(const MessageCallback &cb) { MutableCallbacks()->_message = cb; }
+    void SetClosedCallback(const ClosedCallback &cb) { MutableCallbacks()->_closed = cb; }
+    void SetAnyEventCallback(const AnyEventCallback &cb) { MutableCallbacks()->_event = cb; }
+    void SetWriteCompleteCallback(const WriteCompleteCallback &cb) { MutableCallbacks()->_write_complete = cb; }
+    // 重试次数用完仍然连不上时调用
+    void SetConnectErrorCallback(const Connector::ErrorCallback &cb) { _connector->SetErrorCallback(cb); }
+    void SetConnectTimeout(uint32_t sec) { _connector->SetConnectTimeout(sec); }
+    void SetMaxRetry(int count) { _connector->SetMaxRetry(count); }
+    // 连接断开后自动重新连接
+    void EnableReconnect() { _reconnect = true; }
+    void Connect() { _loop->RunInLoop(std::bind(&TcpClient::ConnectInLoop, this)); }
+    void Disconnect() { _loop->RunInLoop(std::bind(&TcpClient::DisconnectInLoop, this)); }
+    // 当前的连接，只能在 loop 线程中调用
+    PtrConnection GetConnection() { return _conn; }
+};
+
+// 上游连接池: 每个 EventLoop 一个(EventLoop::Upstream())，按 "ip:port" 缓存和上游服务的空闲长连接
+// 取连接时优先复用空闲连接，没有再用 Connector 异步建立，省掉每个请求一次 TCP 握手
+// 拿到的就是普通的 Connection，使用者自己设置回调收发数据，用完调用 Release 归还
+// 只能在所属 loop 线程中使用
+#define UPSTREAM_MAX_IDLE 16     // 每个上游最多缓存的空闲连接数
+#define UPSTREAM_IDLE_TIMEOUT 30 // 空闲连接超过这个时间(秒)没有被使用就关闭
+class UpstreamPool
+{
+public:
+    using AcquireCallback = std::function<void(const PtrConnection &)>; // 连接失败时参数为空
+
+private:
+    EventLoop *_loop;
+    size_t _max_idle;
+    int _idle_timeout;
+    uint32_t _connect_timeout;
+    int _max_retry;
+    PtrCallbacks _idle_callbacks;                                            // 连接池中连接的默认回调，归还时使用者设置的回调都会被清掉
+    std::unordered_map<std::string, std::vector<PtrConnection>> _idle;       // 空闲连接，按上游地址分组
+    std::unordered_map<uint64_t, std::string> _upstreams;                    // 连接池建立的连接 ID -> 上游地址
+    std::unordered_map<Connector *, std::shared_ptr<Connector>> _connecting; // 正在建立的连接
+
+private:
+    static std::string UpstreamKey(const std::string &ip, uint16_t port) { return ip + ":" + std::to_string(port); }
+    void AcquireInLoop(const std::string &ip, uint16_t port, const AcquireCallback &cb)
+    {
+        std::string upstream = UpstreamKey(ip, port);
+        auto it = _idle.find(upstream);
+        if (it != _idle.end())
+        {
+            std::vector<PtrConnection> &conns = it->second;
+            while (conns.empty() == false)
+            {
+                PtrConnection conn = conns.back();
+                conns.pop_back();
+                if (conn->IsConnected() == false)
+                    continue;
+                conn->CancelInactiveRelease();
+                return cb(conn);
+            }
+        }
+        std::shared_ptr<Connector> connector = std::make_shared<Connector>(_loop, ip, port);
+        connector->SetConnectTimeout(_connect_timeout);
+        connector->SetMaxRetry(_max_retry);
+        Connector *key = connector.get();
+        connector->SetNewConnectionCallback([this, key, upstream, cb](int fd)
+                                            {
+            RemoveConnector(key);
+            PtrConnection conn = Connection::Create(_loop, Connector::NextConnId(), fd);
+            conn->SetCallbacks(_idle_callbacks);
+            conn->Established();
+            _loop->AddConnection(conn);
+            _upstreams[conn->Id()] = upstream;
+            cb(conn); });
+        // 错误原因 Connector 已经记录在日志里了，这里只需要通知调用者
+        connector->SetErrorCallback([this, key, cb](int)
+                                    {
+            RemoveConnector(key);
+            cb(PtrConnection()); });
+        _connecting[key] = connector;
+        connector->Start();
+    }
+    void ReleaseInLoop(const PtrConnection &conn)
+    {
+        auto it = _upstreams.find(conn->Id());
+        if (it == _upstreams.end())
+            return; // 不是连接池建立的连接
+        conn->SetCallbacks(_idle_callbacks);
+        std::vector<PtrConnection> &conns = _idle[it->second];
+        // 已经断开的、还有没发完或没读完数据的连接不能再给下一个请求用
+        if (conn->IsConnected() == false || conn->OutputSize() > 0 || conn->InputSize() > 0 || conns.size() >= _max_idle)
+            return conn->Shutdown();
+        conn->EnableInactiveRelease(_idle_timeout);
+        conns.push_back(conn);
+    }
+    // Connector 的回调里不能直接释放 Connector 自己，延后到任务里释放
+    void RemoveConnector(Connector *key)
+    {
+        _loop->QueueInLoop([this, key]()
+                           { _connecting.erase(key); });
+    }
+    // 连接池建立的连接关闭时调用
+    void RemoveConnection(const PtrConnection &conn)
+    {
+        _loop->RemoveConnection(conn->Id());
+        auto it = _upstreams.find(conn->Id());
+        if (it == _upstreams.end())
+            return;
+        auto idle = _idle.find(it->second);
+        if (idle != _idle.end())
+        {
+            std::vector<PtrConnection> &conns = idle->second;
+            conns.erase(std::remove(conns.begin(), conns.end(), conn), conns.end());
+        }
+        _upstreams.erase(it);
+    }
+    // 空闲连接上收到数据(正常不会有)，说明连接状态已经不对了，直接关闭
+    void OnIdleMessage(const PtrConnection &conn, Buffer *buf)
+    {
+        buf->MoveReaderOffset(buf->ReadAbleSize());
+        conn->Shutdown();
+    }
+
+public:
+    UpstreamPool(EventLoop *loop)
+        : _loop(loop), _max_idle(UPSTREAM_MAX_IDLE), _idle_timeout(UPSTREAM_IDLE_TIMEOUT),
+          _connect_timeout(CONNECT_TIMEOUT), _max_retry(0), _idle_callbacks(std::make_shared<ConnectionCallbacks>())
+    {
+        _idle_callbacks->_message = std::bind(&UpstreamPool::OnIdleMessage, this, std::placeholders::_1, std::placeholders::_2);
+        _idle_callbacks->_server_closed = std::bind(&UpstreamPool::RemoveConnection, this, std::placeholders::_1);
+    }
+    void SetMaxIdle(size_t count) { _max_idle = count; }
+    void SetIdleTimeout(int sec) { _idle_timeout = sec; }
+    void SetConnectTimeout(uint32_t sec) { _connect_timeout = sec; }
+    void SetMaxRetry(int count) { _max_retry = count; }
+    // 获取一个到 ip:port 的连接，拿到后(或失败时)调用 cb
+    // 连接上之前设置的回调都已经清掉，使用者要在 cb 里重新设置
+    void Acquire(const std::string &ip, uint16_t port, const AcquireCallback &cb)
+    {
+        _loop->RunInLoop(std::bind(&UpstreamPool::AcquireInLoop, this, ip, port, cb));
+    }
+    // 用完归还连接，连接池会决定是缓存起来还是关闭
+    // 通常是在这个连接自己的回调里归还的，归还会清掉回调，所以放到任务里等当前回调返回后再执行
+    void Release(const PtrConnection &conn)
+    {
+        _loop->QueueInLoop(std::bind(&UpstreamPool::ReleaseInLoop, this, conn));
+    }
+    size_t IdleCount(const std::string &ip, uint16_t port)
+    {
+        auto it = _idle.find(UpstreamKey(ip, port));
+        return it == _idle.end() ? 0 : it->second.size();
+    }
+};
+
+UpstreamPool *EventLoop::Upstream()
+{
+    if (!_upstream)
+        _upstream = std::make_shared<UpstreamPool>(this);
+    return _upstream.get();
+}
+
+// UDP 数据报批量收发: 一次 recvmmsg/sendmmsg 处理一批数据报，减少系统调用次数
+#define UDP_BATCH_SIZE 64         // 一次 recvmmsg/sendmmsg 处理的数据报个数
+#define UDP_DATAGRAM_SIZE 2048    // 不开 GRO 时每个接收槽位的大小(一个数据报不会超过 MTU)
+#define UDP_GRO_BUFFER_SIZE 65536 // 开启 GRO 后内核会把同一来源的多个数据报合并到一个槽位里
+#define UDP_READ_ROUNDS 16        // 一次可读事件最多收几批，避免一个套接字占住整个 loop
+#define UDP_SEND_QUEUE_MAX 65536  // 待发送数据报的上限，超过就丢弃(UDP 本来就不保证送达)
+#define UDP_GSO_MAX_SEGMENTS 64   // 一次 GSO 发送最多合并的数据报个数(内核的上限)
+#define UDP_MAX_PAYLOAD 65507     // 一次发送的最大 UDP 负载(IPv4)，GSO 合并之后的总大小也不能超过
+class UdpSocket
+{
+public:
+    // 收到一个数据报时调用: 参数是收到数据的套接字(用来回复)、对端地址、数据
+    using MessageCallback = std::function<void(UdpSocket *, const struct sockaddr_in &, const char *, size_t)>;
+
+private:
+    struct OutDatagram
+    {
+        struct sockaddr_in addr;
+        size_t offset; // 数据在 _out_data 中的位置
+        size_t len;
+    };
+    EventLoop *_loop;
+    Socket _socket;
+    Channel _channel;
+    bool _gro;         // 接收时让内核合并数据报(UDP_GRO)
+    bool _gso;         // 发送时把发给同一个对端、大小相同的连续数据报合并成一次发送(UDP_SEGMENT)
+    bool _in_batch;    // 正在处理一批收到的数据报，期间的回复攒到这批处理完再一起发送
+    size_t _slot_size; // 每个接收槽位的大小
+    std::vector<char> _recv_data;
+    std::vector<struct mmsghdr> _recv_msgs;
+    std::vector<struct iovec> _recv_iovs;
+    std::vector<struct sockaddr_in> _recv_addrs;
+    std::vector<char> _recv_ctrl; // 每个槽位的控制信息(GRO 合并时每个数据报的大小)
+    std::vector<OutDatagram> _out;
+    std::vector<char> _out_data;
+    std::vector<struct mmsghdr> _send_msgs; // sendmmsg 用的数组，每次 Flush 复用
+    std::vector<struct iovec> _send_iovs;
+    std::vector<size_t> _send_counts;       // 每个 mmsghdr 包含几个数据报
+    std::vector<char> _send_ctrl;           // 每个 mmsghdr 的控制信息(GSO 的分段大小)
+    MessageCallback _message_callback;
+
+private:
+    static size_t ControlSize() { return CMSG_SPACE(sizeof(int)); }
+    static int CreateServer(uint16_t port)
+    {
+        Socket sock;
+        if (sock.CreateUdpServer(port) == false)
+        {
+            ERR_LOG("UDP SERVER CREATE FAILED!");
+            abort();
+        }
+        return sock.ReleaseFd();
+    }
+    void HandleRead()
+    {
+        for (int round = 0; round < UDP_READ_ROUNDS; round++)
+        {
+            for (int i = 0; i < UDP_BATCH_SIZE; i++)
+            {
+                // recvmmsg 会改写地址和控制信息的长度，每次都要重新设置
+                _recv_msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+                _recv_msgs[i].msg_hdr.msg_controllen = _gro ? ControlSize() : 0;
+                _recv_msgs[i].msg_len = 0;
+            }
+            int n = recvmmsg(_socket.Fd(), _recv_msgs.data(), UDP_BATCH_SIZE, MSG_DONTWAIT, nullptr);
+            if (n <= 0)
+            {
+                if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                    ERR_LOG("UDP RECVMMSG FAILED: %s", strerror(errno));
+                break;
+            }
+            _in_batch = true;
+            for (int i = 0; i < n; i++)
+                OnDatagram(i);
+            _in_batch = false;
+            Flush(); // 这一批的回复一起发送
+            if (n < UDP_BATCH_SIZE)
+                break;
+        }
+    }
+    // 处理一个接收槽位: 开启 GRO 时槽位里可能是多个合并在一起的数据报，按分段大小拆开
+    void OnDatagram(int idx)
+    {
+        struct msghdr *hdr = &_recv_msgs[idx].msg_hdr;
+        const char *data = &_recv_data[idx * _slot_size];
+        size_t len = _recv_msgs[idx].msg_len;
+        size_t segment = len;
+#ifdef UDP_GRO
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(hdr); _gro && cmsg != nullptr; cmsg = CMSG_NXTHDR(hdr, cmsg))
+        {
+            if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO)
+            {
+                int size;
+                memcpy(&size, CMSG_DATA(cmsg), sizeof(size));
+                if (size > 0)
+                    segment = size;
+            }
+        }
+#endif
+        if (!_message_callback)
+            return;
+        for (size_t pos = 0; pos < len; pos += segment)
+            _message_callback(this, _recv_addrs[idx], data + pos, std::min(segment, len - pos));
+    }
+    void HandleWrite()
+    {
+        Flush();
+        if (_out.empty())
+            _channel.DisableWrite();
+    }
+    void SendToInLoop(const struct sockaddr_in &addr, const std::string &data)
+    {
+        SendDataInLoop(addr, data.c_str(), data.size());
+    }
+    void SendDataInLoop(const struct sockaddr_in &addr, const char *data, size_t len)
+    {
+        if (_out.size() >= UDP_SEND_QUEUE_MAX)
+        {
+            DBG_LOG("UDP SEND QUEUE FULL, DROP DATAGRAM");
+            return;
+        }
+        _out.push_back({addr, _out_data.size(), len});
+        _out_data.insert(_out_data.end(), data, data + len);
+        // 正在处理收到的一批数据报时先攒着，这批处理完统一发送; 在等可写事件时也先攒着
+        if (_in_batch == false && _channel.WriteAble() == false)
+            Flush();
+    }
+    // 用 sendmmsg 把待发送的数据报尽量发出去，发不完的等可写事件
+    void Flush()
+    {
+        size_t sent = 0;      // 已经发送(或丢弃)的数据报个数
+        size_t no_merge = 0;  // 这个位置之前的数据报不合并: 合并发送失败后拆开重发，只丢掉真正出错的那一个
+        while (sent < _out.size())
+        {
+            int entries = 0;
+            size_t idx = sent;
+            while (entries < UDP_BATCH_SIZE && idx < _out.size())
+            {
+                OutDatagram &first = _out[idx];
+                size_t count = 1;
+                size_t len = first.len;
+#ifdef UDP_SEGMENT
+                // 发给同一个对端、大小相同的连续数据报合并成一次发送，内核按 first.len 重新切分
+                // 数据在 _out_data 中是连续的，只要延长 iovec 就行; 最后一个可以比前面的小
+                while (_gso && idx >= no_merge && first.len > 0 && count < UDP_GSO_MAX_SEGMENTS && idx + count < _out.size())
+                {
+                    OutDatagram &next = _out[idx + count];
+                    if (next.len == 0 || next.len > first.len || _out[idx + count - 1].len != first.len || len + next.len > UDP_MAX_PAYLOAD ||
+                        next.addr.sin_addr.s_addr != first.addr.sin_addr.s_addr || next.addr.sin_port != first.addr.sin_port)
+                        break;
+                    len += next.len;
+                    count++;
+                }
+#endif
+                _send_iovs[entries].iov_base = &_out_data[first.offset];
+                _send_iovs[entries].iov_len = len;
+                struct msghdr *hdr = &_send_msgs[entries].msg_hdr;
+                memset(hdr, 0, sizeof(*hdr));
+                hdr->msg_name = &first.addr;
+                hdr->msg_namelen = sizeof(first.addr);
+                hdr->msg_iov = &_send_iovs[entries];
+                hdr->msg_iovlen = 1;
+#ifdef UDP_SEGMENT
+                if (count > 1)
+                {
+                    hdr->msg_control = &_send_ctrl[entries * ControlSize()];
+                    hdr->msg_controllen = CMSG_SPACE(sizeof(uint16_t));
+                    struct cmsghdr *cmsg = CMSG_FIRSTHDR(hdr);
+                    cmsg->cmsg_level = SOL_UDP;
+                    cmsg->cmsg_type = UDP_SEGMENT;
+                    cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+                    uint16_t segment = first.len;
+                    memcpy(CMSG_DATA(cmsg), &segment, sizeof(segment));
+                }
+#endif
+                _send_counts[entries] = count;
+                idx += count;
+                entries++;
+            }
+            int n = sendmmsg(_socket.Fd(), _send_msgs.data(), entries, MSG_DONTWAIT);
+            if (n < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                    break; // 发送缓冲区满了，等可写事件
+                // 其他错误(比如对端地址不可达)只影响第一个 mmsghdr: 合并发送的先拆开重发，单个的丢掉继续发
+                if (_send_counts[0] > 1)
+                {
+                    no_merge = sent + _send_counts[0];
+                    continue;
+                }
+                ERR_LOG("UDP SENDMMSG FAILED: %s", strerror(errno));
+                n = 1;
+            }
+            for (int i = 0; i < n; i++)
+                sent += _send_counts[i];
+        }
+        _out.erase(_out.begin(), _out.begin() + sent);
+        if (_out.empty())
+        {
+            _out_data.clear();
+            return;
+        }
+        // 只发出去一部分: 把剩下的数据挪到前面，不然 _out_data 要等队列完全清空才会缩小
+        size_t base = _out.front().offset;
+        if (base > 0)
+        {
+            _out_data.erase(_out_data.begin(), _out_data.begin() + base);
+            for (auto &d : _out)
+                d.offset -= base;
+        }
+        if (_channel.WriteAble() == false)
+            _channel.EnableWrite();
+    }
+
+public:
+    UdpSocket(EventLoop *loop, uint16_t port, bool gro = false, bool gso = false)
+        : _loop(loop), _socket(CreateServer(port)), _channel(loop, _socket.Fd()),
+          _gro(false), _gso(gso), _in_batch(false), _slot_size(UDP_DATAGRAM_SIZE)
+    {
+#ifdef UDP_GRO
+        int val = 1;
+        if (gro && setsockopt(_socket.Fd(), SOL_UDP, UDP_GRO, &val, sizeof(val)) == 0)
+        {
+            _gro = true;
+            _slot_size = UDP_GRO_BUFFER_SIZE;
+        }
+#endif
+#ifndef UDP_SEGMENT
+        _gso = false;
+#endif
+        _recv_data.resize(UDP_BATCH_SIZE * _slot_size);
+        _recv_msgs.resize(UDP_BATCH_SIZE);
+        _recv_iovs.resize(UDP_BATCH_SIZE);
+        _recv_addrs.resize(UDP_BATCH_SIZE);
+        _recv_ctrl.resize(_gro ? UDP_BATCH_SIZE * ControlSize() : 0);
+        _send_msgs.resize(UDP_BATCH_SIZE);
+        _send_iovs.resize(UDP_BATCH_SIZE);
+        _send_counts.resize(UDP_BATCH_SIZE);
+        _send_ctrl.resize(_gso ? UDP_BATCH_SIZE * ControlSize() : 0);
+        for (int i = 0; i < UDP_BATCH_SIZE; i++)
+        {
+            _recv_iovs[i].iov_base = &_recv_data[i * _slot_size];
+            _recv_iovs[i].iov_len = _slot_size;
+            struct msghdr *hdr = &_recv_msgs[i].msg_hdr;
+            memset(hdr, 0, sizeof(*hdr));
+            hdr->msg_name = &_recv_addrs[i];
+            hdr->msg_iov = &_recv_iovs[i];
+            hdr->msg_iovlen = 1;
+            if (_gro)
+                hdr->msg_control = &_recv_ctrl[i * ControlSize()];
+        }
+        _channel.SetReadCallback([this]() { HandleRead(); });
+        _channel.SetWriteCallback([this]() { HandleWrite(); });
+    }
+    EventLoop *GetLoop() { return _loop; }
+    void SetMessageCallback(const MessageCallback &cb) { _message_callback = cb; }
+    // 开始接收数据报，要在所属 loop 线程中调用
+    void Start() { _channel.EnableRead(); }
+    // 发送一个数据报，可以在任意线程调用
+    void SendTo(const struct sockaddr_in &addr, const char *data, size_t len)
+    {
+        if (_loop->IsinLoop())
+            return SendDataInLoop(addr, data, len);
+        _loop->RunInLoop(std::bind(&UdpSocket::SendToInLoop, this, addr, std::string(data, len)));
+    }
+};
+
+// UDP 服务器: 每个 EventLoop 一个 UdpSocket，都用 SO_REUSEPORT 绑定同一个端口
+// 内核按来源把数据报分给不同的套接字，各个 loop 线程独立收发，互相之间没有竞争
+class UdpServer
+{
+private:
+    int _port;
+    bool _gro;
+    bool _gso;
+    EventLoop _baseloop;
+    LoopThreadPool _pool;
+    UdpSocket::MessageCallback _message_callback;
+    std::vector<std::unique_ptr<UdpSocket>> _sockets;
+    std::mutex _mutex;
+
+private:
+    // 在 loop 线程中创建这个 loop 的套接字并开始接收
+    void CreateSocket(EventLoop *loop)
+    {
+        std::unique_ptr<UdpSocket> sock(new UdpSocket(loop, _port, _gro, _gso));
+        sock->SetMessageCallback(_message_callback);
+        sock->Start();
+        std::unique_lock<std::mutex> lock(_mutex);
+        _sockets.push_back(std::move(sock));
+    }
+
+public:
+    UdpServer(int port) : _port(port), _gro(false), _gso(false), _pool(&_baseloop) {}
+    void SetThreadCount(int count) { _pool.SetThreadCount(count); }
+    void SetMessageCallback(const UdpSocket::MessageCallback &cb) { _message_callback = cb; }
+    // 接收时让内核合并同一来源的数据报(UDP_GRO)，回调时仍然按单个数据报交给使用者
+    void EnableGro() { _gro = true; }
+    // 发送时把发给同一对端、大小相同的连续数据报合并成一次发送(UDP_SEGMENT)
+    void EnableGso() { _gso = true; }
+    void Start()
+    {
+        _pool.Create();
+        for (auto loop : _pool.AllLoops())
+            loop->RunInLoop(std::bind(&UdpServer::CreateSocket, this, loop));
+        _baseloop.Start();
+    }
+};
@@ -0,0 +1,36 @@
+/*请求走私测试: 给服务器发送有歧义的正文长度，服务器应该直接返回 400 并关闭连接*/
+/*
+    1. 两个值不同的 Content-Length -> 400
+    2. 两个值相同的 Content-Length -> 正常处理
+    3. 两个 Transfer-Encoding -> 400
+*/
+#include "../source/http/http.hpp"
+
+// 发送一个请求，返回响应的状态行
+std::string StatusLine(const std::string &req)
+{
+    Socket cli_sock;
+    cli_sock.CreateClient(8086, "127.0.0.1");
+    assert(cli_sock.Send(req.c_str(), req.size()) != -1);
+    char buf[1024] = {0};
+    assert(cli_sock.Recv(buf, 1023) > 0);
+    cli_sock.Close();
+    std::string rsp(buf);
+    return rsp.substr(0, rsp.find("\r\n"));
+}
+
+int main()
+{
+    std::string line = StatusLine("POST /login HTTP/1.1\r\nContent-Length: 0\r\nContent-Length: 5\r\n\r\nhello");
+    DBG_LOG("[%s]", line.c_str());
+    assert(line == "HTTP/1.1 400 Bad Request");
+
+    line = StatusLine("POST /login HTTP/1.1\r\nContent-Length: 5\r\nContent-Length: 5\r\nConnection: close\r\n\r\nhello");
+    DBG_LOG("[%s]", line.c_str());
+    assert(line == "HTTP/1.1 200 OK");
+
+    line = StatusLine("POST /login HTTP/1.1\r\nTransfer-Encoding: chunked\r\nTransfer-Encoding: identity\r\n\r\n5\r\nhello\r\n0\r\n\r\n");
+    DBG_LOG("[%s]", line.c_str());
+    assert(line == "HTTP/1.1 400 Bad Request");
+    return 0;
+}
@@ -0,0 +1,77 @@
+/*RPC 客户端测试: 用 RpcClient 连接 source/rpc 的示例服务器(端口 9090)，同一个连接上流水线发送请求*/
+/*
+    1. 先发 slow(工作线程里睡 200ms)再发 echo: echo 先返回，响应按完成的顺序发送，不等前面的请求
+    2. 不存在的方法 -> RPC_NO_METHOD
+    3. 方法名超过 65535 字节 -> 不发送，直接以 RPC_BAD_REQUEST 结束
+    4. 服务器每个连接最多同时处理 64 个请求: 先发 64 个 delay(1 秒后完成)再发一个 echo，
+       echo 留在服务器的输入缓冲区里，要等有 delay 完成、服务器恢复读取之后才会被处理
+*/
+#include "../source/rpc/rpc.hpp"
+
+#define DELAY_COUNT 64 // 和示例服务器的 SetMaxInflight 一致
+
+int main()
+{
+    EventLoop loop;
+    RpcClient client(&loop, "127.0.0.1", 9090);
+    client.Connect();
+    std::vector<std::string> order; // 响应到达的顺序
+    int delay_done = 0;
+    auto step2 = [&]()
+    {
+        order.clear();
+        for (int i = 0; i < DELAY_COUNT; i++)
+        {
+            client.Call("delay", std::to_string(i), [&](RpcStatus status, std::string_view)
+                        {
+                assert(status == RPC_OK);
+                order.push_back("delay");
+                delay_done++; });
+        }
+        client.Call("echo", "last", [&](RpcStatus status, std::string_view rsp)
+                    {
+            assert(status == RPC_OK && rsp == "last");
+            order.push_back("echo");
+            // 达到上限时服务器暂停了读取: echo 一定在某个 delay 之后
+            DBG_LOG("echo after %d delay responses", delay_done);
+            assert(delay_done > 0);
+            assert(client.Pending() == (size_t)(DELAY_COUNT - delay_done));
+            loop.RunAfter([&]()
+                          {
+                assert(delay_done == DELAY_COUNT);
+                DBG_LOG("all passed");
+                exit(0); }, 2); });
+    };
+    int done = 0;
+    auto finish = [&]()
+    {
+        if (++done < 4)
+            return;
+        assert(order.size() == 2 && order[0] == "echo" && order[1] == "slow");
+        step2();
+    };
+    client.Call("slow", "a", [&](RpcStatus status, std::string_view rsp)
+                {
+        assert(status == RPC_OK && rsp == "slow:a");
+        order.push_back("slow");
+        finish(); });
+    client.Call("echo", "b", [&](RpcStatus status, std::string_view rsp)
+                {
+        assert(status == RPC_OK && rsp == "b");
+        order.push_back("echo");
+        finish(); });
+    client.Call("nope", "", [&](RpcStatus status, std::string_view)
+                {
+        assert(status == RPC_NO_METHOD);
+        finish(); });
+    client.Call(std::string(70000, 'm'), "", [&](RpcStatus status, std::string_view)
+                {
+        assert(status == RPC_BAD_REQUEST);
+        finish(); });
+    loop.RunAfter([]()
+                  {
+        ERR_LOG("timeout");
+        exit(1); }, 10);
+    loop.Start();
+    return 0;
+}
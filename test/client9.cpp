@@ -0,0 +1,64 @@
+/*请求解析测试: 请求被拆成很多次到达，以及请求行、头部超过上限时，服务器返回的状态码*/
+/*
+    1. 请求一个字节一个字节地发送(每次都是不完整的行，解析要从上次找过的位置接着找) -> 200
+    2. 请求行超过 MAX_LINE -> 414
+    3. 单个头部行超过 MAX_LINE -> 431
+    4. 头部字段超过 MAX_HEADER_COUNT 个 -> 431
+    5. 每行都不超过上限，但整个头部超过 MAX_HEADER_SIZE -> 431
+    6. 不支持的协议版本 HTTP/2.0 -> 505
+*/
+#include "../source/http/http.hpp"
+#include <netinet/tcp.h>
+
+// 发送一个请求(split 为 true 时一个字节一个字节地发)，返回响应的状态行
+std::string StatusLine(const std::string &req, bool split = false)
+{
+    Socket cli_sock;
+    cli_sock.CreateClient(8086, "127.0.0.1");
+    int opt = 1;
+    setsockopt(cli_sock.Fd(), IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+    if (split)
+    {
+        for (char ch : req)
+        {
+            assert(cli_sock.Send(&ch, 1) != -1);
+            usleep(500);
+        }
+    }
+    else
+        assert(cli_sock.Send(req.c_str(), req.size()) != -1);
+    char buf[1024] = {0};
+    assert(cli_sock.Recv(buf, 1023) > 0);
+    cli_sock.Close();
+    std::string rsp(buf);
+    return rsp.substr(0, rsp.find("\r\n"));
+}
+void Check(const std::string &name, const std::string &req, const std::string &expect, bool split = false)
+{
+    std::string line = StatusLine(req, split);
+    DBG_LOG("%s: [%s]", name.c_str(), line.c_str());
+    assert(line == expect);
+}
+
+int main()
+{
+    Check("split", "GET /hello?a=1 HTTP/1.1\r\nHost: 127.0.0.1\r\nX-Test: abc\r\nConnection: close\r\n\r\n", "HTTP/1.1 200 OK", true);
+
+    Check("long line", "GET /" + std::string(MAX_LINE, 'a') + " HTTP/1.1\r\n\r\n", "HTTP/1.1 414 URI Too Long");
+
+    Check("long header", "GET /hello HTTP/1.1\r\nX-Long: " + std::string(MAX_LINE, 'a') + "\r\n\r\n",
+          "HTTP/1.1 431 Request Header Fields Too Large");
+
+    std::string req = "GET /hello HTTP/1.1\r\n";
+    for (int i = 0; i <= MAX_HEADER_COUNT; i++)
+        req += "X-H" + std::to_string(i) + ": v\r\n";
+    Check("header count", req + "\r\n", "HTTP/1.1 431 Request Header Fields Too Large");
+
+    req = "GET /hello HTTP/1.1\r\n";
+    for (int i = 0; req.size() <= MAX_HEADER_SIZE; i++)
+        req += "X-H" + std::to_string(i) + ": " + std::string(MAX_LINE / 2, 'a') + "\r\n";
+    Check("header size", req + "\r\n", "HTTP/1.1 431 Request Header Fields Too Large");
+
+    Check("version", "GET /hello HTTP/2.0\r\n\r\n", "HTTP/1.1 505 HTTP Version Not Supported");
+    return 0;
+}